@@ -0,0 +1,763 @@
+/*
+ * gstfs - cache of transcoded files
+ *
+ * The cache is split into shards by path hash, each with its own lock,
+ * hash table and replacement policy state, so lookups of different files
+ * don't contend.  Budgets are enforced by an evictor thread rather than on
+ * the lookup path; it asks every shard's policy for its best victim and
+ * evicts the one with the lowest key.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <glib.h>
+#include "gstfs.h"
+#include "stats.h"
+#include "trace.h"
+
+#define CACHE_SHARDS 16
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+struct cache_shard
+{
+    pthread_mutex_t mutex;       /* protects this shard and its entries */
+    GHashTable *files;           /* cache of transcoded audio */
+    GQueue lists[2];             /* resident entries, per the policy */
+    GHashTable *ghosts;          /* evicted filename -> ghost list, or NULL */
+    GQueue ghost_lists[2];       /* ghost filenames in LRU order */
+    guint arc_p;                 /* arc's target length of lists[0] */
+};
+
+/*
+ *  A replacement policy.  All hooks are called with the shard mutex held.
+ *  victim returns the entry the shard would evict first, skipping entries
+ *  in use, along with a key comparable across shards: lowest goes first.
+ *  update, if set, is called when an entry's size or cost changed.
+ */
+struct cache_policy
+{
+    const char *name;
+    void (*insert)(struct cache_shard *shard, struct gstfs_file_info *fi,
+        int touch);
+    void (*touch)(struct cache_shard *shard, struct gstfs_file_info *fi);
+    struct gstfs_file_info *(*victim)(struct cache_shard *shard, double *key);
+    void (*evict)(struct cache_shard *shard, struct gstfs_file_info *fi);
+    void (*update)(struct gstfs_file_info *fi);  /* optional */
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+static const struct cache_policy *policy;
+
+/* totals over all shards, checked against the budget */
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_cond = PTHREAD_COND_INITIALIZER;
+static guint cache_entries;      /* # of entries in all shards */
+static size_t cache_bytes;       /* total alloc_len of cached entries */
+static size_t pressure_bytes;    /* byte budget under memory pressure, or 0 */
+static double gdsf_clock;        /* gdsf's inflation value L */
+
+/*
+ *  Return true if nothing is using fi, so it may be freed.  On success,
+ *  fi->mutex is returned locked.
+ *
+ *  Called with the shard mutex held.
+ */
+static int can_evict(struct gstfs_file_info *fi)
+{
+    if (fi->refs || pthread_mutex_trylock(&fi->mutex) == EBUSY)
+        return 0;
+
+    /* transcode thread still appends to it, keep it around */
+    if (fi->transcoding)
+    {
+        pthread_mutex_unlock(&fi->mutex);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ *  Return the first entry of a list that is not in use, or NULL.
+ */
+static struct gstfs_file_info *first_idle(GQueue *list)
+{
+    GList *node;
+
+    for (node = list->head; node; node = node->next)
+    {
+        struct gstfs_file_info *fi = node->data;
+
+        if (can_evict(fi))
+        {
+            pthread_mutex_unlock(&fi->mutex);
+            return fi;
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Helpers to move entries between the lists of a shard.
+ */
+static void list_unlink(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    if (fi->list_node)
+        g_queue_delete_link(&shard->lists[fi->list], fi->list_node);
+    fi->list_node = NULL;
+}
+
+static void list_push_tail(struct cache_shard *shard, int list,
+    struct gstfs_file_info *fi)
+{
+    list_unlink(shard, fi);
+    g_queue_push_tail(&shard->lists[list], fi);
+    fi->list_node = shard->lists[list].tail;
+    fi->list = list;
+}
+
+static void list_push_head(struct cache_shard *shard, int list,
+    struct gstfs_file_info *fi)
+{
+    list_unlink(shard, fi);
+    g_queue_push_head(&shard->lists[list], fi);
+    fi->list_node = shard->lists[list].head;
+    fi->list = list;
+}
+
+/*
+ *  Number of entries the policy of a single shard should plan for.  With
+ *  only a byte budget there is no fixed number, so go by the current one.
+ */
+static guint shard_capacity(struct cache_shard *shard)
+{
+    guint c;
+
+    if (mount_info.max_cache_entries < G_MAXINT)
+        c = mount_info.max_cache_entries / CACHE_SHARDS;
+    else
+        c = g_hash_table_size(shard->files);
+    return max(c, 1);
+}
+
+/*
+ *  Ghost lists remember the names of recently evicted entries, so that
+ *  2q and arc can tell a file coming back from one seen for the first time.
+ */
+static int ghost_take(struct cache_shard *shard, const char *name);
+
+static void ghost_add(struct cache_shard *shard, int list, const char *name)
+{
+    char *key = g_strdup(name);
+
+    ghost_take(shard, name);
+    g_queue_push_tail(&shard->ghost_lists[list], key);
+    g_hash_table_replace(shard->ghosts, key, GINT_TO_POINTER(list + 1));
+}
+
+static void ghost_trim(struct cache_shard *shard, int list, guint max_len)
+{
+    while (g_queue_get_length(&shard->ghost_lists[list]) > max_len)
+    {
+        char *key = g_queue_pop_head(&shard->ghost_lists[list]);
+
+        g_hash_table_remove(shard->ghosts, key);
+        g_free(key);
+    }
+}
+
+/*
+ *  Return the ghost list name was in and forget it, or -1.
+ */
+static int ghost_take(struct cache_shard *shard, const char *name)
+{
+    gpointer key, value;
+    int list;
+
+    if (!g_hash_table_lookup_extended(shard->ghosts, name, &key, &value))
+        return -1;
+
+    list = GPOINTER_TO_INT(value) - 1;
+    g_hash_table_remove(shard->ghosts, key);
+    g_queue_remove(&shard->ghost_lists[list], key);
+    g_free(key);
+    return list;
+}
+
+/*
+ *  lru: a single list in order of last open.  Entries only ever stat'ed
+ *  join at the cold end, so a scan doesn't flush what is being played.
+ */
+static void lru_insert(struct cache_shard *shard, struct gstfs_file_info *fi,
+    int touch)
+{
+    if (touch)
+        list_push_tail(shard, 0, fi);
+    else
+        list_push_head(shard, 0, fi);
+}
+
+static void lru_touch(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    list_push_tail(shard, 0, fi);
+}
+
+static struct gstfs_file_info *lru_victim(struct cache_shard *shard,
+    double *key)
+{
+    struct gstfs_file_info *fi = first_idle(&shard->lists[0]);
+
+    if (fi)
+        *key = fi->last_access;
+    return fi;
+}
+
+static void lru_evict(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    list_unlink(shard, fi);
+}
+
+/*
+ *  2q: new entries go to a FIFO (lists[0], "A1in") and are only promoted
+ *  to the LRU (lists[1], "Am") when opened again after falling out of it,
+ *  as remembered by a ghost list ("A1out").  Most entries are created by
+ *  a stat and only opened later, so the ghosts are looked at on an
+ *  entry's first open, not when it is created.
+ */
+#define TWOQ_IN  0
+#define TWOQ_AM  1
+
+static void twoq_insert(struct cache_shard *shard, struct gstfs_file_info *fi,
+    int touch)
+{
+    if (touch && ghost_take(shard, fi->filename) >= 0)
+        list_push_tail(shard, TWOQ_AM, fi);
+    else
+        list_push_tail(shard, TWOQ_IN, fi);
+}
+
+static void twoq_touch(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    if (fi->list == TWOQ_AM ||
+        (fi->hits == 1 && ghost_take(shard, fi->filename) >= 0))
+        list_push_tail(shard, TWOQ_AM, fi);
+}
+
+static struct gstfs_file_info *twoq_victim(struct cache_shard *shard,
+    double *key)
+{
+    guint kin = max(g_hash_table_size(shard->files) / 4, 1);
+    struct gstfs_file_info *fi = NULL;
+
+    /* the FIFO goes first, in any shard, once it is over its share */
+    if (g_queue_get_length(&shard->lists[TWOQ_IN]) > kin &&
+        (fi = first_idle(&shard->lists[TWOQ_IN])))
+    {
+        *key = fi->last_access - 1e15;
+        return fi;
+    }
+
+    if (!(fi = first_idle(&shard->lists[TWOQ_AM])))
+        fi = first_idle(&shard->lists[TWOQ_IN]);
+    if (fi)
+        *key = fi->last_access;
+    return fi;
+}
+
+static void twoq_evict(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    if (fi->list == TWOQ_IN)
+    {
+        ghost_add(shard, 0, fi->filename);
+        ghost_trim(shard, 0, max(shard_capacity(shard) / 2, 1));
+    }
+    list_unlink(shard, fi);
+}
+
+/*
+ *  arc: lists[0] ("T1") holds entries opened once, lists[1] ("T2") those
+ *  opened again; the target length of T1 adapts to hits in the ghosts of
+ *  either list.  As with 2q, the ghosts are looked at on an entry's first
+ *  open, which usually comes after a stat created it.
+ */
+#define ARC_T1 0
+#define ARC_T2 1
+
+/*
+ *  Place fi on its first open: in T2 if it was evicted not long ago,
+ *  adapting the target length of T1, else at the hot end of T1.
+ */
+static void arc_first_use(struct cache_shard *shard,
+    struct gstfs_file_info *fi)
+{
+    guint c = shard_capacity(shard);
+    guint b1 = g_queue_get_length(&shard->ghost_lists[ARC_T1]);
+    guint b2 = g_queue_get_length(&shard->ghost_lists[ARC_T2]);
+    int ghost = ghost_take(shard, fi->filename);
+
+    if (ghost == ARC_T1)
+    {
+        shard->arc_p = min(c, shard->arc_p + max(b2 / max(b1, 1), 1));
+        list_push_tail(shard, ARC_T2, fi);
+    }
+    else if (ghost == ARC_T2)
+    {
+        guint delta = max(b1 / max(b2, 1), 1);
+
+        shard->arc_p = shard->arc_p > delta ? shard->arc_p - delta : 0;
+        list_push_tail(shard, ARC_T2, fi);
+    }
+    else
+        list_push_tail(shard, ARC_T1, fi);
+}
+
+static void arc_insert(struct cache_shard *shard, struct gstfs_file_info *fi,
+    int touch)
+{
+    if (touch)
+        arc_first_use(shard, fi);
+    else
+        list_push_head(shard, ARC_T1, fi);
+}
+
+static void arc_touch(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    if (fi->hits == 1)
+        arc_first_use(shard, fi);
+    else
+        list_push_tail(shard, ARC_T2, fi);
+}
+
+static struct gstfs_file_info *arc_victim(struct cache_shard *shard,
+    double *key)
+{
+    struct gstfs_file_info *fi;
+    int list;
+
+    list = g_queue_get_length(&shard->lists[ARC_T1]) > shard->arc_p ?
+        ARC_T1 : ARC_T2;
+    fi = first_idle(&shard->lists[list]);
+    if (!fi)
+        fi = first_idle(&shard->lists[!list]);
+
+    if (fi)
+        *key = fi->last_access;
+    return fi;
+}
+
+static void arc_evict(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    guint c = shard_capacity(shard);
+
+    ghost_add(shard, fi->list, fi->filename);
+    ghost_trim(shard, fi->list, c);
+    list_unlink(shard, fi);
+}
+
+/*
+ *  gdsf: greedy dual size frequency.  Each entry's priority is
+ *  L + opens * cost / size, where cost is what it took to transcode it
+ *  and size what it holds in memory; the lowest priority goes first and
+ *  L rises to the priority of every evicted entry.
+ */
+static void gdsf_weigh(struct gstfs_file_info *fi)
+{
+    double cost = fi->transcode_usecs;
+    double size = max(fi->alloc_len, 1);
+
+    /* cheap to bring back from cache_dir, and takes no memory */
+    if (fi->on_disk)
+        cost = 1;
+
+    pthread_mutex_lock(&budget_mutex);
+    fi->priority = gdsf_clock + fi->hits * cost / size;
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+static void gdsf_insert(struct cache_shard *shard, struct gstfs_file_info *fi,
+    int touch)
+{
+    list_push_tail(shard, 0, fi);
+    gdsf_weigh(fi);
+}
+
+static void gdsf_touch(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    gdsf_weigh(fi);
+}
+
+static struct gstfs_file_info *gdsf_victim(struct cache_shard *shard,
+    double *key)
+{
+    struct gstfs_file_info *victim = NULL;
+    GList *node;
+
+    for (node = shard->lists[0].head; node; node = node->next)
+    {
+        struct gstfs_file_info *fi = node->data;
+
+        if ((!victim || fi->priority < victim->priority) && can_evict(fi))
+        {
+            pthread_mutex_unlock(&fi->mutex);
+            victim = fi;
+        }
+    }
+
+    if (victim)
+        *key = victim->priority;
+    return victim;
+}
+
+static void gdsf_evict(struct cache_shard *shard, struct gstfs_file_info *fi)
+{
+    pthread_mutex_lock(&budget_mutex);
+    gdsf_clock = max(gdsf_clock, fi->priority);
+    pthread_mutex_unlock(&budget_mutex);
+    list_unlink(shard, fi);
+}
+
+static const struct cache_policy policies[] = {
+    { "lru", lru_insert, lru_touch, lru_victim, lru_evict, NULL },
+    { "2q", twoq_insert, twoq_touch, twoq_victim, twoq_evict, NULL },
+    { "arc", arc_insert, arc_touch, arc_victim, arc_evict, NULL },
+    { "gdsf", gdsf_insert, gdsf_touch, gdsf_victim, gdsf_evict, gdsf_weigh },
+};
+
+/*
+ *  Set up empty shards using the named replacement policy, lru if NULL.
+ *  Called once before the filesystem is mounted.
+ *
+ *  Returns 0, or -1 if there is no such policy.
+ */
+int cache_init(const char *policy_name)
+{
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(policies) && !policy; i++)
+    {
+        if (!policy_name || !strcmp(policy_name, policies[i].name))
+            policy = &policies[i];
+    }
+    if (!policy)
+        return -1;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        shards[i].files = g_hash_table_new(g_str_hash, g_str_equal);
+        shards[i].ghosts = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    return 0;
+}
+
+/*
+ *  Return true if the cache holds more entries or bytes than allowed.
+ *
+ *  Called with budget_mutex held.
+ */
+static int cache_over_budget()
+{
+    if (cache_entries > mount_info.max_cache_entries)
+        return 1;
+
+    if (pressure_bytes && cache_bytes > pressure_bytes)
+        return 1;
+
+    return mount_info.max_cache_bytes &&
+           cache_bytes > mount_info.max_cache_bytes;
+}
+
+/*
+ *  Wake the evictor if the cache is over budget.  Also called when an
+ *  entry it had to skip may have become evictable.
+ */
+void cache_kick(void)
+{
+    pthread_mutex_lock(&budget_mutex);
+    if (cache_over_budget())
+        pthread_cond_signal(&budget_cond);
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+/*
+ *  Return true if another entry holding bytes could be cached without
+ *  going over budget, so that speculative work doesn't push out files
+ *  somebody is using.
+ */
+int cache_has_room(size_t bytes)
+{
+    int ret;
+
+    pthread_mutex_lock(&budget_mutex);
+    ret = cache_entries < mount_info.max_cache_entries &&
+          (!mount_info.max_cache_bytes ||
+           cache_bytes + bytes <= mount_info.max_cache_bytes) &&
+          (!pressure_bytes || cache_bytes + bytes <= pressure_bytes);
+    pthread_mutex_unlock(&budget_mutex);
+    return ret;
+}
+
+/*
+ *  Hold the cache to bytes on top of its budget while the system is
+ *  short of memory, or lift that limit again with 0.  The evictor only
+ *  drops entries nobody is using, least valuable first.
+ */
+void cache_set_pressure_limit(size_t bytes)
+{
+    pthread_mutex_lock(&budget_mutex);
+    pressure_bytes = bytes;
+    if (cache_over_budget())
+        pthread_cond_signal(&budget_cond);
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+/*
+ *  Add delta to the number of bytes held by cached entries.
+ */
+void cache_account(ssize_t delta)
+{
+    pthread_mutex_lock(&budget_mutex);
+    cache_bytes += delta;
+    if (delta > 0 && cache_over_budget())
+        pthread_cond_signal(&budget_cond);
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+/*
+ *  Report the number of cached entries and the bytes they hold.
+ */
+void cache_usage(guint *entries, size_t *bytes)
+{
+    pthread_mutex_lock(&budget_mutex);
+    *entries = cache_entries;
+    *bytes = cache_bytes;
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+/*
+ *  Let the policy re-weigh fi after its size or transcode cost changed.
+ */
+void cache_update(struct gstfs_file_info *fi)
+{
+    struct cache_shard *shard = &shards[fi->shard];
+
+    if (!policy->update)
+        return;
+
+    pthread_mutex_lock(&shard->mutex);
+    policy->update(fi);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ *  Evict the entry with the lowest key over all shards.
+ *  Returns false if every entry is in use.
+ */
+static int evict_one()
+{
+    struct gstfs_file_info *fi, *victim = NULL;
+    struct cache_shard *shard;
+    double key, lowest = 0;
+    int i, victim_shard = 0;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&shards[i].mutex);
+        fi = policy->victim(&shards[i], &key);
+        if (fi && (!victim || key < lowest))
+        {
+            victim = fi;
+            victim_shard = i;
+            lowest = key;
+        }
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+
+    if (!victim)
+        return 0;
+
+    /* it may have been looked up again since, so check once more */
+    shard = &shards[victim_shard];
+    pthread_mutex_lock(&shard->mutex);
+    if (victim != policy->victim(shard, &key) || !can_evict(victim))
+    {
+        pthread_mutex_unlock(&shard->mutex);
+        return 1;
+    }
+
+    policy->evict(shard, victim);
+    g_hash_table_remove(shard->files, victim->filename);
+    pthread_mutex_unlock(&victim->mutex);
+    pthread_mutex_unlock(&shard->mutex);
+
+    pthread_mutex_lock(&budget_mutex);
+    cache_entries--;
+    cache_bytes -= victim->alloc_len;
+    pthread_mutex_unlock(&budget_mutex);
+
+    stats_add(STATS_EVICTIONS, 1);
+    put_file_info(victim);
+    return 1;
+}
+
+/*
+ *  Remove items from the file cache whenever it goes over budget.  When
+ *  everything left is in use, wait to be kicked again.
+ */
+static void *evict_thread(void *data)
+{
+    int stuck = 0;
+
+    pthread_mutex_lock(&budget_mutex);
+    for (;;)
+    {
+        if (stuck || !cache_over_budget())
+        {
+            pthread_cond_wait(&budget_cond, &budget_mutex);
+            stuck = 0;
+            continue;
+        }
+        pthread_mutex_unlock(&budget_mutex);
+
+        stuck = !evict_one();
+
+        pthread_mutex_lock(&budget_mutex);
+    }
+    return NULL;
+}
+
+/*
+ *  Start the evictor thread.
+ */
+void cache_start(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, evict_thread, NULL))
+        fprintf(stderr, "gstfs: could not start cache evictor\n");
+    else
+        pthread_detach(thread);
+}
+
+/*
+ *  Look for path in the cache, creating a new file info if it isn't
+ *  there unless CACHE_PEEK is given.  With CACHE_PIN, the entry is kept
+ *  in the cache until cache_unpin.  Only lookups with CACHE_TOUCH, i.e.
+ *  opens, count as a use of the file for the replacement policy.
+ */
+struct gstfs_file_info *cache_lookup(const char *path, int flags)
+{
+    struct gstfs_file_info *ret, *fi = NULL;
+    int n = g_str_hash(path) % CACHE_SHARDS;
+    struct cache_shard *shard = &shards[n];
+    int touch = flags & CACHE_TOUCH;
+
+    TRACE1(shard_lock, path);
+    pthread_mutex_lock(&shard->mutex);
+    TRACE1(shard_locked, path);
+    ret = g_hash_table_lookup(shard->files, path);
+    if (!ret && (flags & CACHE_PEEK))
+    {
+        pthread_mutex_unlock(&shard->mutex);
+        return NULL;
+    }
+    if (!ret)
+    {
+        /* creating an entry stats files, so don't hold up the shard */
+        pthread_mutex_unlock(&shard->mutex);
+        fi = get_file_info(path);
+        if (!fi)
+            return NULL;
+        fi->shard = n;
+
+        pthread_mutex_lock(&shard->mutex);
+        ret = g_hash_table_lookup(shard->files, path);
+        if (!ret)
+        {
+            ret = fi;
+            fi = NULL;
+            g_hash_table_replace(shard->files, ret->filename, ret);
+            /* entries only stat'ed sort with the oldest */
+            if (touch)
+            {
+                ret->last_access = g_get_monotonic_time();
+                ret->hits++;
+            }
+            policy->insert(shard, ret, touch);
+
+            pthread_mutex_lock(&budget_mutex);
+            cache_entries++;
+            if (cache_over_budget())
+                pthread_cond_signal(&budget_cond);
+            pthread_mutex_unlock(&budget_mutex);
+            touch = 0;
+        }
+    }
+
+    if (flags & CACHE_PIN)
+        ret->refs++;
+
+    if (touch)
+    {
+        ret->last_access = g_get_monotonic_time();
+        ret->hits++;
+        policy->touch(shard, ret);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    /* somebody else created it first */
+    if (fi)
+        put_file_info(fi);
+    return ret;
+}
+
+/*
+ *  Remove fi from the cache right away, so that the next lookup of its
+ *  path creates a new entry.  Returns false if it is in use or was
+ *  already replaced, in which case it is left alone.
+ */
+int cache_drop(struct gstfs_file_info *fi)
+{
+    struct cache_shard *shard = &shards[fi->shard];
+
+    pthread_mutex_lock(&shard->mutex);
+    if (g_hash_table_lookup(shard->files, fi->filename) != fi ||
+        !can_evict(fi))
+    {
+        pthread_mutex_unlock(&shard->mutex);
+        return 0;
+    }
+
+    policy->evict(shard, fi);
+    g_hash_table_remove(shard->files, fi->filename);
+    pthread_mutex_unlock(&fi->mutex);
+    pthread_mutex_unlock(&shard->mutex);
+
+    pthread_mutex_lock(&budget_mutex);
+    cache_entries--;
+    cache_bytes -= fi->alloc_len;
+    pthread_mutex_unlock(&budget_mutex);
+
+    put_file_info(fi);
+    return 1;
+}
+
+/*
+ *  Release an entry pinned by cache_lookup.
+ */
+void cache_unpin(struct gstfs_file_info *fi)
+{
+    struct cache_shard *shard = &shards[fi->shard];
+    int refs;
+
+    pthread_mutex_lock(&shard->mutex);
+    refs = --fi->refs;
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (!refs)
+        cache_kick();
+}
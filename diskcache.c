@@ -0,0 +1,331 @@
+/*
+ * gstfs - persistent on-disk cache of transcoded files
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <utime.h>
+#include <glib.h>
+#include "diskcache.h"
+
+/* how often a lease is renewed and how long after its holder is gone */
+#define LEASE_RENEW_SECS 20
+#define LEASE_SECS 120
+
+/* leases held by this process, renewed by lease_thread */
+static pthread_mutex_t lease_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lease_once = PTHREAD_ONCE_INIT;
+static GHashTable *leases;           /* lock file -> itself */
+
+/*
+ *  Return the cache key for src_filename, whose attributes are stbuf,
+ *  transcoded with pipeline, as a hex string.  The key covers the source
+ *  path, mtime and size as well as the pipeline, so a changed source or a
+ *  different pipeline simply misses.
+ */
+char *diskcache_key(const char *src_filename, const struct stat *stbuf,
+    const char *pipeline)
+{
+    GChecksum *sum;
+    char *stamp, *key;
+
+    stamp = g_strdup_printf("%lld:%lld", (long long) stbuf->st_mtime,
+        (long long) stbuf->st_size);
+
+    sum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(sum, (const guchar *) src_filename, -1);
+    g_checksum_update(sum, (const guchar *) "", 1);
+    g_checksum_update(sum, (const guchar *) stamp, -1);
+    g_checksum_update(sum, (const guchar *) "", 1);
+    g_checksum_update(sum, (const guchar *) pipeline, -1);
+    key = g_strdup(g_checksum_get_string(sum));
+
+    g_checksum_free(sum);
+    g_free(stamp);
+    return key;
+}
+
+/*
+ *  Like diskcache_key, but for a cache_dir shared by hosts that may see
+ *  the sources under other paths.  Instead of the path, the key covers
+ *  the inode number along with the mtime and size, which hosts mounting
+ *  the same export see alike, and which change with any edit of the
+ *  source, so no source data needs to be read to find its entry.
+ */
+char *diskcache_content_key(const struct stat *stbuf, const char *pipeline)
+{
+    GChecksum *sum;
+    char *stamp, *key;
+
+    stamp = g_strdup_printf("%llu:%lld:%lld",
+        (unsigned long long) stbuf->st_ino, (long long) stbuf->st_mtime,
+        (long long) stbuf->st_size);
+
+    sum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(sum, (const guchar *) stamp, -1);
+    g_checksum_update(sum, (const guchar *) "", 1);
+    g_checksum_update(sum, (const guchar *) pipeline, -1);
+    key = g_strdup(g_checksum_get_string(sum));
+
+    g_checksum_free(sum);
+    g_free(stamp);
+    return key;
+}
+
+/*
+ *  Return the cache file for key.  Entries are spread over 256
+ *  subdirectories named after the first byte of the key.
+ */
+char *diskcache_path(const char *cache_dir, const char *key)
+{
+    return g_strdup_printf("%s/%.2s/%s", cache_dir, key, key + 2);
+}
+
+/*
+ *  Create the subdirectory path goes in.  Returns 0 or -errno.
+ */
+static int make_dir(const char *path)
+{
+    char *dir;
+    int ret = 0;
+
+    dir = g_path_get_dirname(path);
+    if (mkdir(dir, 0755) && errno != EEXIST)
+        ret = -errno;
+    g_free(dir);
+    return ret;
+}
+
+/*
+ *  Create a temporary file next to path for a new cache entry.  The entry
+ *  only becomes visible under path once diskcache_commit succeeds.
+ *
+ *  Returns the fd, or -errno.
+ */
+int diskcache_create(const char *path, char **tmp_path)
+{
+    int fd;
+
+    if ((fd = make_dir(path)))
+        return fd;
+
+    *tmp_path = g_strdup_printf("%s.XXXXXX", path);
+    fd = mkstemp(*tmp_path);
+    if (fd == -1)
+    {
+        fd = -errno;
+        g_free(*tmp_path);
+        *tmp_path = NULL;
+    }
+    return fd;
+}
+
+/*
+ *  Write all of buf to fd.  Returns 0 on success, or -errno.
+ */
+int diskcache_write(int fd, const char *buf, size_t len)
+{
+    ssize_t written;
+
+    while (len)
+    {
+        written = write(fd, buf, len);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/*
+ *  Atomically publish a completed entry under path.  Closes fd and frees
+ *  tmp_path in all cases.  Returns 0 on success, or -errno.
+ */
+int diskcache_commit(int fd, char *tmp_path, const char *path)
+{
+    int ret = 0;
+
+    if (fsync(fd))
+        ret = -errno;
+    if (close(fd) && !ret)
+        ret = -errno;
+    if (!ret && rename(tmp_path, path))
+        ret = -errno;
+
+    if (ret)
+        unlink(tmp_path);
+    g_free(tmp_path);
+    return ret;
+}
+
+/*
+ *  Throw away an entry that was never committed.
+ */
+void diskcache_abort(int fd, char *tmp_path)
+{
+    close(fd);
+    unlink(tmp_path);
+    g_free(tmp_path);
+}
+
+/*
+ *  Keep the leases held from going stale while their transcodes run.
+ */
+static void *lease_thread(void *data)
+{
+    GHashTableIter iter;
+    gpointer lock;
+
+    for (;;)
+    {
+        sleep(LEASE_RENEW_SECS);
+
+        pthread_mutex_lock(&lease_mutex);
+        g_hash_table_iter_init(&iter, leases);
+        while (g_hash_table_iter_next(&iter, &lock, NULL))
+            utime(lock, NULL);
+        pthread_mutex_unlock(&lease_mutex);
+    }
+    return NULL;
+}
+
+/*
+ *  Start the thread renewing the leases, once the first one is taken.
+ */
+static void lease_start(void)
+{
+    pthread_t thread;
+
+    leases = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    if (pthread_create(&thread, NULL, lease_thread, NULL))
+        fprintf(stderr, "gstfs: could not start lease renewal\n");
+    else
+        pthread_detach(thread);
+}
+
+/*
+ *  Make one attempt at claiming the entry at path, see diskcache_claim.
+ *  If another host holds the lease, -EBUSY is returned with the
+ *  attributes of its lock file in *lock_st.
+ */
+static int try_claim(const char *path, const char *lock,
+    struct stat *lock_st)
+{
+    struct stat stbuf;
+    char *owner;
+    int fd, ret;
+
+    if (!stat(path, &stbuf))
+        return 1;
+    if ((ret = make_dir(path)))
+        return ret;
+
+    fd = open(lock, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1)
+    {
+        if (errno != EEXIST)
+            return -errno;
+
+        /* released just now: try again on the next round */
+        if (stat(lock, lock_st))
+            memset(lock_st, 0, sizeof(*lock_st));
+        return -EBUSY;
+    }
+
+    /* only for whoever looks at the cache_dir */
+    owner = g_strdup_printf("%s %d\n", g_get_host_name(), (int) getpid());
+    diskcache_write(fd, owner, strlen(owner));
+    g_free(owner);
+    close(fd);
+
+    /* the entry may have been committed since we looked */
+    if (!stat(path, &stbuf))
+    {
+        unlink(lock);
+        return 1;
+    }
+
+    pthread_once(&lease_once, lease_start);
+    pthread_mutex_lock(&lease_mutex);
+    g_hash_table_replace(leases, g_strdup(lock), NULL);
+    pthread_mutex_unlock(&lease_mutex);
+    return 0;
+}
+
+/*
+ *  Claim the entry at path in a cache_dir that other hosts may be
+ *  filling too.  Returns 1 once the entry exists, or 0 once this process
+ *  holds the lease on producing it, which diskcache_release gives back.
+ *  Meanwhile, whoever holds the lease is waited for.
+ *
+ *  A lock file whose mtime hasn't moved for LEASE_SECS by our own clock
+ *  belongs to a host that went away and is taken over.  Two hosts doing
+ *  that at once may both end up transcoding, which only wastes the work,
+ *  as entries are committed atomically.
+ *
+ *  With wait false, or once cancelled returns true, -EBUSY is returned
+ *  instead of waiting.  Other errors, e.g. of a read-only cache_dir, are
+ *  returned as -errno.
+ */
+int diskcache_claim(const char *path, int wait, int (*cancelled)(void))
+{
+    struct stat lock_st;
+    time_t mtime = 0;
+    ino_t ino = 0;
+    gint64 now, since = 0;
+    char *lock;
+    int ret;
+
+    lock = g_strdup_printf("%s.lock", path);
+    while ((ret = try_claim(path, lock, &lock_st)) == -EBUSY)
+    {
+        if (!wait || (cancelled && cancelled()))
+            break;
+
+        now = g_get_monotonic_time();
+        if (!since || lock_st.st_mtime != mtime || lock_st.st_ino != ino)
+        {
+            mtime = lock_st.st_mtime;
+            ino = lock_st.st_ino;
+            since = now;
+        }
+        else if (now - since > (gint64) LEASE_SECS * G_USEC_PER_SEC)
+        {
+            unlink(lock);
+            since = 0;
+            continue;
+        }
+        sleep(1);
+    }
+    g_free(lock);
+    return ret;
+}
+
+/*
+ *  Give back the lease taken by diskcache_claim, once the entry is
+ *  committed or given up on.
+ */
+void diskcache_release(const char *path)
+{
+    char *lock = g_strdup_printf("%s.lock", path);
+
+    pthread_mutex_lock(&lease_mutex);
+    g_hash_table_remove(leases, lock);
+    pthread_mutex_unlock(&lease_mutex);
+
+    unlink(lock);
+    g_free(lock);
+}
@@ -0,0 +1,18 @@
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+char *diskcache_key(const char *src_filename, const struct stat *stbuf,
+    const char *pipeline);
+char *diskcache_content_key(const struct stat *stbuf, const char *pipeline);
+char *diskcache_path(const char *cache_dir, const char *key);
+int diskcache_create(const char *path, char **tmp_path);
+int diskcache_write(int fd, const char *buf, size_t len);
+int diskcache_commit(int fd, char *tmp_path, const char *path);
+void diskcache_abort(int fd, char *tmp_path);
+int diskcache_claim(const char *path, int wait, int (*cancelled)(void));
+void diskcache_release(const char *path);
+
+#endif /* _DISKCACHE_H */
@@ -0,0 +1,516 @@
+/*
+ *  gstfs-bench - throughput and latency benchmark for gstfs
+ *
+ *  Generates a corpus of wave files with audiotestsrc, mounts gstfs on it
+ *  and reports time to first byte and throughput of cold transcodes, MB/s
+ *  of cached reads by parallel readers, getattr and readdir rates on a
+ *  large directory, and the peak RSS of the gstfs process.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <gst/gst.h>
+
+#define DEFAULT_PIPELINE \
+    "filesrc name=_source ! wavparse ! audioconvert ! flacenc ! " \
+    "appsink name=_dest sync=false"
+
+#define READ_SIZE (128 * 1024)
+
+static struct bench_opts
+{
+    const char *gstfs;           /* gstfs binary to mount with */
+    char *workdir;               /* holds the corpus and the mount point */
+    const char *pipeline;        /* pipeline of the mount */
+    const char *dst_ext;         /* extension the pipeline produces */
+    const char *mount_opts;      /* extra -o options for gstfs */
+    int nfiles;                  /* # of tracks to transcode */
+    int seconds;                 /* length of each track */
+    int nreaders;                /* # of parallel readers of cached files */
+    int rounds;                  /* # of times each reader reads all tracks */
+    int dirsize;                 /* # of entries in the large directory */
+    int keep;                    /* don't remove the corpus when done */
+} opts = {
+    "gstfs", NULL, DEFAULT_PIPELINE, "flac", NULL, 8, 30, 4, 4, 5000, 0
+};
+
+static char *src_dir, *mnt_dir;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n\n"
+           "where options can be:\n"
+           "   -g gstfs        gstfs binary (default: gstfs)\n"
+           "   -w directory    work directory (default: a new one in /tmp)\n"
+           "   -n files        number of tracks (default: 8)\n"
+           "   -s seconds      length of each track (default: 30)\n"
+           "   -r readers      parallel readers of cached files (default: 4)\n"
+           "   -i rounds       reads of every track per reader (default: 4)\n"
+           "   -d entries      size of the large directory (default: 5000)\n"
+           "   -p pipeline     pipeline to mount with, producing -x files\n"
+           "   -x extension    extension of transcoded files (default: flac)\n"
+           "   -o options      further mount options, e.g. cache_policy=arc\n"
+           "   -k              keep the work directory\n",
+           prog);
+}
+
+static double now(void)
+{
+    return g_get_monotonic_time() / 1e6;
+}
+
+/*
+ *  Write seconds of pink noise to path as a wave file.
+ */
+static int generate_track(const char *path, int seconds)
+{
+    GstElement *pipeline;
+    GstMessage *msg;
+    GstBus *bus;
+    GError *error = NULL;
+    char *desc;
+    int ret = -1;
+
+    /* 10 buffers of 4410 samples per second */
+    desc = g_strdup_printf("audiotestsrc wave=pink-noise samplesperbuffer=4410"
+        " num-buffers=%d ! audio/x-raw-int,rate=44100,channels=2,width=16,"
+        "depth=16 ! wavenc ! filesink location=\"%s\"", seconds * 10, path);
+    pipeline = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if (error)
+    {
+        fprintf(stderr, "gstfs-bench: %s\n", error->message);
+        g_error_free(error);
+        if (pipeline)
+            gst_object_unref(pipeline);
+        return -1;
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+    msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE,
+        GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    gst_object_unref(bus);
+    if (msg)
+    {
+        if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS)
+            ret = 0;
+        gst_message_unref(msg);
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+
+    if (ret)
+        fprintf(stderr, "gstfs-bench: could not generate %s\n", path);
+    return ret;
+}
+
+/*
+ *  Create the tracks and a large directory of hard links to a short one.
+ */
+static int make_corpus(void)
+{
+    char *many, *first, *path;
+    int i, ret = 0;
+
+    many = g_strdup_printf("%s/many", src_dir);
+    first = g_strdup_printf("%s/0.wav", many);
+    if (mkdir(src_dir, 0755) || mkdir(many, 0755))
+    {
+        perror("gstfs-bench: corpus");
+        ret = -1;
+    }
+
+    for (i = 0; !ret && i < opts.nfiles; i++)
+    {
+        path = g_strdup_printf("%s/track%03d.wav", src_dir, i);
+        ret = generate_track(path, opts.seconds);
+        g_free(path);
+    }
+
+    if (!ret)
+        ret = generate_track(first, 1);
+
+    for (i = 1; !ret && i < opts.dirsize; i++)
+    {
+        path = g_strdup_printf("%s/%d.wav", many, i);
+        if (link(first, path))
+        {
+            perror("gstfs-bench: corpus");
+            ret = -1;
+        }
+        g_free(path);
+    }
+
+    g_free(first);
+    g_free(many);
+    return ret;
+}
+
+/*
+ *  Start gstfs in the foreground on mnt_dir and wait for the mount to
+ *  appear.  Returns its pid, or -1.
+ */
+static pid_t mount_gstfs(void)
+{
+    char *mount_opts, *stats;
+    struct stat stbuf;
+    pid_t pid;
+    int i;
+
+    mount_opts = g_strdup_printf("src=%s,src_ext=wav,dst_ext=%s,"
+        "pipeline=%s%s%s", src_dir, opts.dst_ext, opts.pipeline,
+        opts.mount_opts ? "," : "", opts.mount_opts ? opts.mount_opts : "");
+
+    if (mkdir(mnt_dir, 0755) && errno != EEXIST)
+    {
+        perror("gstfs-bench: mount point");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+        execlp(opts.gstfs, opts.gstfs, "-f", "-o", mount_opts, mnt_dir,
+            (char *) NULL);
+        perror("gstfs-bench: gstfs");
+        _exit(127);
+    }
+    g_free(mount_opts);
+    if (pid == -1)
+    {
+        perror("gstfs-bench: fork");
+        return -1;
+    }
+
+    /* the stats file only exists once gstfs answers */
+    stats = g_strdup_printf("%s/.gstfs/stats", mnt_dir);
+    for (i = 0; i < 100 && stat(stats, &stbuf); i++)
+    {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            pid = -1;
+            break;
+        }
+        usleep(100000);
+    }
+    g_free(stats);
+
+    if (pid != -1 && i == 100)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        pid = -1;
+    }
+    if (pid == -1)
+        fprintf(stderr, "gstfs-bench: mount failed\n");
+    return pid;
+}
+
+/*
+ *  Unmount and reap gstfs.  Returns its peak RSS in KiB, or -1.
+ */
+static long unmount_gstfs(pid_t pid)
+{
+    struct rusage ru;
+    pid_t umount_pid;
+
+    umount_pid = fork();
+    if (umount_pid == 0)
+    {
+        execlp("fusermount", "fusermount", "-u", mnt_dir, (char *) NULL);
+        _exit(127);
+    }
+    if (umount_pid > 0)
+        waitpid(umount_pid, NULL, 0);
+
+    if (wait4(pid, NULL, 0, &ru) != pid)
+        return -1;
+    return ru.ru_maxrss;
+}
+
+/*
+ *  Read path to the end.  If ttfb isn't NULL, it is set to the time until
+ *  the first read returned.  Returns the number of bytes read, or -1.
+ */
+static ssize_t read_file(const char *path, char *buf, double *ttfb)
+{
+    double start = now();
+    ssize_t count, total = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    while ((count = read(fd, buf, READ_SIZE)) > 0)
+    {
+        if (ttfb && !total)
+            *ttfb = now() - start;
+        total += count;
+    }
+    close(fd);
+    return count ? -1 : total;
+}
+
+static char *track_path(int i)
+{
+    return g_strdup_printf("%s/track%03d.%s", mnt_dir, i, opts.dst_ext);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  Read every track once, each starting a transcode.
+ */
+static int bench_cold(void)
+{
+    double *ttfb = g_new0(double, opts.nfiles);
+    char *buf = g_malloc(READ_SIZE);
+    double start, elapsed;
+    ssize_t bytes = 0;
+    int i, ret = 0;
+
+    start = now();
+    for (i = 0; !ret && i < opts.nfiles; i++)
+    {
+        char *path = track_path(i);
+        ssize_t count = read_file(path, buf, &ttfb[i]);
+
+        if (count < 0)
+        {
+            fprintf(stderr, "gstfs-bench: reading %s failed\n", path);
+            ret = -1;
+        }
+        bytes += count;
+        g_free(path);
+    }
+    elapsed = now() - start;
+
+    if (!ret)
+    {
+        qsort(ttfb, opts.nfiles, sizeof(*ttfb), cmp_double);
+        printf("ttfb_ms min %.1f median %.1f max %.1f\n", ttfb[0] * 1e3,
+            ttfb[opts.nfiles / 2] * 1e3, ttfb[opts.nfiles - 1] * 1e3);
+        printf("transcode_mb_per_s %.2f\n", bytes / elapsed / (1 << 20));
+        printf("transcode_realtime_factor %.1f\n",
+            opts.nfiles * opts.seconds / elapsed);
+    }
+
+    g_free(buf);
+    g_free(ttfb);
+    return ret;
+}
+
+struct reader
+{
+    pthread_t thread;
+    int first;                   /* track to start at */
+    ssize_t bytes;               /* bytes read, or -1 on error */
+};
+
+static void *reader_thread(void *data)
+{
+    struct reader *r = data;
+    char *buf = g_malloc(READ_SIZE);
+    int i;
+
+    for (i = 0; r->bytes >= 0 && i < opts.rounds * opts.nfiles; i++)
+    {
+        char *path = track_path((r->first + i) % opts.nfiles);
+        ssize_t count = read_file(path, buf, NULL);
+
+        r->bytes = count < 0 ? -1 : r->bytes + count;
+        g_free(path);
+    }
+    g_free(buf);
+    return NULL;
+}
+
+/*
+ *  Read the now cached tracks from parallel readers.
+ */
+static int bench_cached(void)
+{
+    struct reader *readers = g_new0(struct reader, opts.nreaders);
+    double start, elapsed;
+    ssize_t bytes = 0;
+    int i, ret = 0;
+
+    start = now();
+    for (i = 0; i < opts.nreaders; i++)
+    {
+        readers[i].first = i;
+        pthread_create(&readers[i].thread, NULL, reader_thread, &readers[i]);
+    }
+    for (i = 0; i < opts.nreaders; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        if (readers[i].bytes < 0)
+            ret = -1;
+        bytes += readers[i].bytes;
+    }
+    elapsed = now() - start;
+
+    if (ret)
+        fprintf(stderr, "gstfs-bench: cached reads failed\n");
+    else
+        printf("cached_read_mb_per_s %.2f (%d readers)\n",
+            bytes / elapsed / (1 << 20), opts.nreaders);
+
+    g_free(readers);
+    return ret;
+}
+
+/*
+ *  Repeatedly list and stat the large directory for about a second each.
+ */
+static int bench_metadata(void)
+{
+    char *many = g_strdup_printf("%s/many", mnt_dir);
+    GPtrArray *names = g_ptr_array_new();
+    struct dirent *dirent;
+    struct stat stbuf;
+    double start, elapsed;
+    long ops;
+    DIR *dir;
+    guint i;
+
+    start = now();
+    for (ops = 0; (elapsed = now() - start) < 1 || !ops; ops++)
+    {
+        if (!(dir = opendir(many)))
+        {
+            perror("gstfs-bench: readdir");
+            g_free(many);
+            return -1;
+        }
+        while ((dirent = readdir(dir)))
+        {
+            if (!ops && dirent->d_name[0] != '.')
+                g_ptr_array_add(names, g_strdup_printf("%s/%s", many,
+                    dirent->d_name));
+        }
+        closedir(dir);
+    }
+    printf("readdir_per_s %.1f (%u entries)\n", ops / elapsed, names->len);
+
+    start = now();
+    for (ops = 0; (elapsed = now() - start) < 1 || !ops; )
+    {
+        for (i = 0; i < names->len; i++, ops++)
+            stat(g_ptr_array_index(names, i), &stbuf);
+    }
+    printf("getattr_per_s %.1f\n", ops / elapsed);
+
+    for (i = 0; i < names->len; i++)
+        g_free(g_ptr_array_index(names, i));
+    g_ptr_array_free(names, TRUE);
+    g_free(many);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag,
+    struct FTW *ftw)
+{
+    return remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+    long peak_rss;
+    pid_t pid;
+    int c, ret;
+
+    gst_init(&argc, &argv);
+
+    while ((c = getopt(argc, argv, "g:w:n:s:r:i:d:p:x:o:kh")) != -1)
+    {
+        switch (c)
+        {
+        case 'g': opts.gstfs = optarg; break;
+        case 'w': opts.workdir = g_strdup(optarg); break;
+        case 'n': opts.nfiles = atoi(optarg); break;
+        case 's': opts.seconds = atoi(optarg); break;
+        case 'r': opts.nreaders = atoi(optarg); break;
+        case 'i': opts.rounds = atoi(optarg); break;
+        case 'd': opts.dirsize = atoi(optarg); break;
+        case 'p': opts.pipeline = optarg; break;
+        case 'x': opts.dst_ext = optarg; break;
+        case 'o': opts.mount_opts = optarg; break;
+        case 'k': opts.keep = 1; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : -1;
+        }
+    }
+
+    if (opts.nfiles < 1 || opts.seconds < 1 || opts.nreaders < 1 ||
+        opts.rounds < 1 || opts.dirsize < 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (opts.workdir)
+        ret = mkdir(opts.workdir, 0755) && errno != EEXIST;
+    else
+    {
+        opts.workdir = g_strdup("/tmp/gstfs-bench.XXXXXX");
+        ret = !mkdtemp(opts.workdir);
+    }
+    if (ret)
+    {
+        perror("gstfs-bench: work directory");
+        return -1;
+    }
+    src_dir = g_strdup_printf("%s/src", opts.workdir);
+    mnt_dir = g_strdup_printf("%s/mnt", opts.workdir);
+
+    ret = make_corpus();
+    if (!ret && (pid = mount_gstfs()) == -1)
+        ret = -1;
+
+    if (!ret)
+    {
+        ret = bench_cold();
+        if (!ret)
+            ret = bench_cached();
+        if (!ret)
+            ret = bench_metadata();
+
+        peak_rss = unmount_gstfs(pid);
+        if (peak_rss >= 0)
+            printf("peak_rss_kb %ld\n", peak_rss);
+    }
+
+    if (opts.keep)
+        printf("work directory: %s\n", opts.workdir);
+    else
+    {
+        /* only what we created, in case -w named a directory in use */
+        nftw(src_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        rmdir(mnt_dir);
+        rmdir(opts.workdir);
+    }
+    return ret;
+}
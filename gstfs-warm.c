@@ -0,0 +1,437 @@
+/*
+ *  gstfs-warm - fill the persistent cache of a gstfs mount ahead of time
+ *
+ *  Takes the options of the mount, walks its source directory and
+ *  transcodes every file the mount would show transcoded into cache_dir
+ *  and the size index, on max_transcodes workers, without going through
+ *  FUSE.  Entries are only published once complete, and those already
+ *  there are skipped, so an interrupted run simply picks up again.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fuse.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include "xcode.h"
+#include "diskcache.h"
+#include "sizeindex.h"
+#include "gstfs.h"
+
+/* one file of one profile to put into the cache */
+struct warm_job
+{
+    char *src_filename;          /* file in the source mount */
+    struct gstfs_profile *profile;
+    char *pipeline;              /* the profile's for the source type */
+    char *cache_key;
+    char *cache_filename;
+    off_t src_size;
+};
+
+/* a cache entry being written by a transcode */
+struct warm_output
+{
+    int fd;
+    size_t len;
+};
+
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GPtrArray *jobs;
+static guint next_job;           /* first job nobody took yet */
+static int verbose;
+static volatile sig_atomic_t stopping;
+
+/* results, protected by jobs_mutex */
+static guint cached_files, transcoded, failed;
+static guint shared;             /* done by other hosts meanwhile */
+static guint64 src_bytes, out_bytes;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-v] -o [options]\n\n"
+           "Transcodes the files a gstfs mount with the same options would\n"
+           "show into its cache_dir, which is required.  max_transcodes\n"
+           "files are transcoded at once.\n\n"
+           "   -v              list the files as they are done\n",
+           prog);
+}
+
+static void stop(int sig)
+{
+    stopping = 1;
+}
+
+static int is_stopping(void)
+{
+    return stopping;
+}
+
+static char *job_name(struct warm_job *job)
+{
+    if (!job->profile->name)
+        return g_strdup(job->src_filename);
+    return g_strdup_printf("%s (%s)", job->src_filename, job->profile->name);
+}
+
+/*
+ *  Describe an error returned by gstfs_transcode or the disk cache.
+ */
+static const char *describe(int ret)
+{
+    if (ret == -1 || ret == -2)
+        return "could not set up pipeline";
+    return strerror(-ret);
+}
+
+/*
+ *  Queue the transcode of a source file by profile p, unless it is in
+ *  the cache already.  An entry whose size is missing from the index
+ *  gets it.
+ */
+static void add_job(const char *src_filename, const struct stat *stbuf,
+    struct gstfs_profile *p)
+{
+    struct warm_job *job;
+    struct stat cached;
+    char *key, *cache_filename, *pipeline;
+    size_t size;
+
+    pipeline = p->pipelines[source_type(src_filename)];
+    if (mount_info.shared_cache)
+        key = diskcache_content_key(stbuf, pipeline);
+    else
+        key = diskcache_key(src_filename, stbuf, pipeline);
+    if (!key)
+        return;
+
+    cache_filename = diskcache_path(mount_info.cache_dir, key);
+    if (!stat(cache_filename, &cached))
+    {
+        if (!sizeindex_lookup(key, &size))
+            sizeindex_store(key, cached.st_size);
+        g_free(cache_filename);
+        g_free(key);
+        cached_files++;
+        return;
+    }
+
+    job = g_new(struct warm_job, 1);
+    job->src_filename = g_strdup(src_filename);
+    job->profile = p;
+    job->pipeline = pipeline;
+    job->cache_key = key;
+    job->cache_filename = cache_filename;
+    job->src_size = stbuf->st_size;
+    g_ptr_array_add(jobs, job);
+}
+
+/*
+ *  Return true if the mount shows the source file name in source_dir
+ *  transcoded by profile p: it is of a source type other than dst_ext,
+ *  and neither a file of the source nor one of an earlier source type
+ *  takes the name it is shown as.
+ */
+static int is_shown_transcoded(const char *source_dir, const char *name,
+    const struct gstfs_profile *p)
+{
+    const char *ext = strrchr(name, '.');
+    int i, t = source_type(name), ret;
+    struct stat stbuf;
+    char *shown, *path;
+
+    shown = shown_name(name, p);
+    ret = t >= 0 && strcmp(shown, name);
+    if (ret)
+    {
+        path = g_strdup_printf("%s/%s", source_dir, shown);
+        ret = stat(path, &stbuf) != 0;
+        g_free(path);
+    }
+    g_free(shown);
+
+    for (i = 0; i < t && ret; i++)
+    {
+        path = g_strdup_printf("%s/%.*s.%s", source_dir, (int) (ext - name),
+            name, mount_info.src_types[i].ext);
+        ret = stat(path, &stbuf) != 0;
+        g_free(path);
+    }
+    return ret;
+}
+
+/*
+ *  Queue the files below mount directory rel, named like gstfs does so
+ *  that the cache keys match.  visited holds the directories seen, so
+ *  that symlinks can't make us go round in circles.
+ */
+static void walk(const char *rel, GHashTable *visited)
+{
+    struct dirent *dirent;
+    struct stat stbuf;
+    char *source_dir, *path, *sub, *id;
+    DIR *dir;
+    int i;
+
+    source_dir = g_strdup_printf("%s%s", mount_info.src_mnt, rel);
+    dir = opendir(source_dir);
+    if (!dir)
+    {
+        fprintf(stderr, "gstfs-warm: %s: %s\n", source_dir, strerror(errno));
+        g_free(source_dir);
+        return;
+    }
+
+    while (!stopping && (dirent = readdir(dir)))
+    {
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+            continue;
+
+        sub = g_strdup_printf("%s/%s", strcmp(rel, "/") ? rel : "",
+            dirent->d_name);
+        path = g_strdup_printf("%s%s", mount_info.src_mnt, sub);
+        if (stat(path, &stbuf))
+            memset(&stbuf, 0, sizeof(stbuf));
+
+        if (S_ISDIR(stbuf.st_mode))
+        {
+            id = g_strdup_printf("%llu:%llu",
+                (unsigned long long) stbuf.st_dev,
+                (unsigned long long) stbuf.st_ino);
+            if (!g_hash_table_lookup(visited, id))
+            {
+                g_hash_table_insert(visited, id, id);
+                walk(sub, visited);
+            }
+            else
+                g_free(id);
+        }
+        else if (S_ISREG(stbuf.st_mode))
+        {
+            for (i = 0; i < mount_info.nprofiles; i++)
+            {
+                if (is_shown_transcoded(source_dir, dirent->d_name,
+                    &mount_info.profiles[i]))
+                    add_job(path, &stbuf, &mount_info.profiles[i]);
+            }
+        }
+        g_free(path);
+        g_free(sub);
+    }
+    closedir(dir);
+    g_free(source_dir);
+}
+
+static int write_cb(char *buf, size_t size, void *data)
+{
+    struct warm_output *out = (struct warm_output *) data;
+
+    if (stopping)
+        return -EINTR;
+
+    out->len += size;
+    return diskcache_write(out->fd, buf, size);
+}
+
+/*
+ *  Transcode a job into its cache entry, which only appears once it's
+ *  complete.  Returns 0 or a negative error.
+ */
+static int transcode_job(struct warm_job *job, size_t *len)
+{
+    struct warm_output out;
+    char *tmp_path;
+    int ret;
+
+    out.fd = diskcache_create(job->cache_filename, &tmp_path);
+    if (out.fd < 0)
+        return out.fd;
+    out.len = 0;
+
+    ret = gstfs_transcode(job->pipeline, job->src_filename,
+        write_cb, &out);
+    if (!ret && !out.len)
+        ret = -EIO;
+    if (ret)
+    {
+        diskcache_abort(out.fd, tmp_path);
+        return ret;
+    }
+
+    ret = diskcache_commit(out.fd, tmp_path, job->cache_filename);
+    if (!ret)
+        sizeindex_store(job->cache_key, out.len);
+    *len = out.len;
+    return ret;
+}
+
+/*
+ *  Run a job, first taking the lease on its entry if the cache_dir is
+ *  shared.  Returns 0, 1 if another host made the entry meanwhile, or a
+ *  negative error.
+ */
+static int run_job(struct warm_job *job, size_t *len)
+{
+    int ret;
+
+    if (!mount_info.shared_cache)
+        return transcode_job(job, len);
+
+    ret = diskcache_claim(job->cache_filename, 1, is_stopping);
+    if (ret == -EBUSY)
+        return -EINTR;
+    if (ret == 1)
+        return 1;
+
+    /* without leases, transcode anyway */
+    if (ret)
+        return transcode_job(job, len);
+
+    ret = transcode_job(job, len);
+    diskcache_release(job->cache_filename);
+    return ret;
+}
+
+static void *worker_thread(void *data)
+{
+    struct warm_job *job;
+    size_t len = 0;
+    char *name;
+    int ret;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&jobs_mutex);
+        job = (!stopping && next_job < jobs->len) ?
+            g_ptr_array_index(jobs, next_job++) : NULL;
+        pthread_mutex_unlock(&jobs_mutex);
+        if (!job)
+            break;
+
+        ret = run_job(job, &len);
+        if (ret == -EINTR && stopping)
+            break;
+
+        name = job_name(job);
+        if (ret < 0)
+            fprintf(stderr, "gstfs-warm: %s: %s\n", name, describe(ret));
+        else if (verbose)
+            printf("%s\n", name);
+        g_free(name);
+
+        pthread_mutex_lock(&jobs_mutex);
+        if (ret < 0)
+            failed++;
+        else if (ret)
+            shared++;
+        else
+        {
+            transcoded++;
+            src_bytes += job->src_size;
+            out_bytes += len;
+        }
+        pthread_mutex_unlock(&jobs_mutex);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    GHashTable *visited;
+    pthread_t *threads;
+    double start, secs;
+    guint nthreads, i;
+    int ret;
+
+    if (gstfs_parse_opts(&args))
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    /* fuse options the mount would take are of no concern here */
+    for (i = 1; i < (guint) args.argc; i++)
+    {
+        if (!strcmp(args.argv[i], "-v"))
+            verbose = 1;
+        else if (!strcmp(args.argv[i], "-o"))
+            i++;
+        else
+        {
+            usage(argv[0]);
+            return strcmp(args.argv[i], "-h") ? -1 : 0;
+        }
+    }
+
+    if (!mount_info.cache_dir)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (gstfs_check_paths())
+        return -1;
+
+    if ((ret = sizeindex_open(mount_info.size_index)))
+    {
+        fprintf(stderr, "gstfs-warm: size index: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    gst_init(NULL, NULL);
+    gstfs_transcode_set_pool_size(mount_info.npipelines);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    start = g_get_monotonic_time() / 1e6;
+    jobs = g_ptr_array_new();
+    visited = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    walk("/", visited);
+    g_hash_table_destroy(visited);
+
+    nthreads = MIN((guint) mount_info.max_transcodes, MAX(jobs->len, 1));
+    threads = g_new(pthread_t, nthreads);
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker_thread, NULL))
+        {
+            fprintf(stderr, "gstfs-warm: could not start worker\n");
+            break;
+        }
+    }
+    nthreads = i;
+
+    /* without any worker, the jobs are run right here */
+    if (!nthreads)
+        worker_thread(NULL);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    g_free(threads);
+
+    secs = g_get_monotonic_time() / 1e6 - start;
+    printf("files %u\n", cached_files + jobs->len);
+    printf("cached %u\n", cached_files);
+    printf("transcoded %u\n", transcoded);
+    printf("failed %u\n", failed);
+    if (mount_info.shared_cache)
+        printf("shared %u\n", shared);
+    printf("left %u\n", jobs->len - transcoded - failed - shared);
+    printf("source_mb %.1f\n", src_bytes / 1048576.0);
+    printf("output_mb %.1f\n", out_bytes / 1048576.0);
+    printf("seconds %.1f\n", secs);
+    if (secs > 0)
+    {
+        printf("files_per_sec %.2f\n", transcoded / secs);
+        printf("source_mb_per_sec %.2f\n", src_bytes / 1048576.0 / secs);
+    }
+    return (failed || stopping) ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 /*
  *  gstfs - a gstreamer filesystem
  */
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <dirent.h>
 #include <pthread.h>
@@ -8,57 +9,127 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <fuse.h>
 #include <errno.h>
 #include <glib.h>
 #include <gst/gst.h>
 #include "xcode.h"
+#include "diskcache.h"
+#include "segbuf.h"
+#include "sizeindex.h"
+#include "stats.h"
+#include "pathcache.h"
+#include "gstfs.h"
+#include "trace.h"
 #include "config.h"
 
 #define min(a,b) ((a)<(b)?(a):(b))
 #define max(a,b) ((a)>(b)?(a):(b))
 
-#define GSTFS_OPT_KEY(templ, elem, key) \
-    { templ, offsetof(struct gstfs_mount_info, elem), key }
+/* virtual files, answered by gstfs itself */
+#define STATS_DIR  "/.gstfs"
+#define STATS_FILE "/.gstfs/stats"
 
-/* per-mount options and data structures */
-struct gstfs_mount_info
+/* attr_timeout and entry_timeout unless given, in seconds */
+#define DEFAULT_KERNEL_TTL "10"
+
+/* decoded before each part of a segmented transcode, to settle encoders */
+#define SEGMENT_MARGIN GST_SECOND
+
+/* reads this far ahead of a transcode, in seconds, start one of their own */
+#define SEEK_DISTANCE_SECS 30
+
+/* how far that transcode may run ahead of its reader, in seconds */
+#define SEEK_WINDOW_SECS 60
+
+/* bytes of the file looked for in the output of that transcode, and how
+ * far off from where the bitrate puts them they may be */
+#define SEEK_PROBE_LEN 4096
+#define SEEK_PROBE_SLACK (64 * 1024)
+
+/* a failed transcode is retried after this many seconds, doubling each
+ * time it fails again up to FAIL_BACKOFF_MAX, or when the source changes */
+#define FAIL_BACKOFF_SECS 10
+#define FAIL_BACKOFF_MAX 3600
+
+/* read size when loading an entry another host put into cache_dir */
+#define FETCH_CHUNK (64 * 1024)
+
+
+/* part of a segmented transcode */
+struct xcode_segment
 {
-    pthread_mutex_t cache_mutex; /* protects file_cache, cache_lru accesses */
-    GHashTable *file_cache;      /* cache of transcoded audio */
-    GQueue *cache_lru;           /* queue of items in LRU order */
-    int max_cache_entries;       /* max # of entries in the cache */
-    char *src_mnt;               /* directory we are mirroring */
-    char *src_ext;               /* extension of files we transcode */
-    char *dst_ext;               /* extension of target files */
-    char *pipeline;              /* gstreamer pipeline */
+    struct gstfs_file_info *info;
+    long long start, stop;         /* the part of the source, in ns */
+    pthread_mutex_t mutex;         /* protects the rest */
+    struct segbuf buf;             /* output until it may be appended */
+    size_t len;                    /* bytes in buf */
+    size_t alloc_len;              /* allocated size of buf */
+    int direct;                    /* append output to info right away */
+    int cancelled;                 /* an earlier part failed */
+    int ret;                       /* result of transcoding the part */
 };
 
-/* This stuff is stored into file_cache by filename */
-struct gstfs_file_info
+/* output ahead of a transcode, for a reader that seeked there */
+struct seek_fill
 {
-    char *filename;           /* hash key */
-    char *src_filename;       /* filename in other mount */
-    pthread_mutex_t mutex;    /* protects this file info */
-    size_t len;               /* size of file */
-    size_t alloc_len;         /* allocated size of buf */
-    char *buf;                /* completely converted file */
-    GList *list_node;         /* pointer for cache_lru */
+    struct gstfs_file_info *info;
+    size_t start;                  /* offset of the data in the file */
+    size_t len;                    /* bytes produced so far */
+    size_t wanted;                 /* end of the last read, from start */
+    size_t alloc_len;              /* allocated size of buf */
+    struct segbuf buf;
+    int reconciled;                /* start matched against the file */
+    size_t skip;                   /* bytes of buf before the match */
+    int running;                   /* its transcode hasn't returned yet */
+    int cancelled;                 /* no longer info's seek fill */
 };
-static char *get_source_path(const char *filename);
 
-static struct gstfs_mount_info mount_info;
+/* per-open state, stored in fuse_file_info->fh */
+struct gstfs_handle
+{
+    int fd;                        /* source or cache_dir file, or -1 */
+    off_t fd_size;                 /* size of fd when it was opened */
+    struct gstfs_file_info *info;  /* transcoded file, NULL if passthrough */
+    char *text;                    /* contents of a virtual file, or NULL */
+    size_t text_len;
+};
+static void resolve_path(const char *filename, struct source_info *si);
+static char *get_source_path(const char *filename);
+static int get_listing(const char *path, struct dir_listing **listing);
 
 void usage(const char *prog)
 {
     printf("Usage: %s -o [options] mount_point\n\n"
            "where options can be:\n"
            "   src=[source directory]    (required)\n"
-           "   src_ext=[mp3|ogg|...]     (required)\n"
-           "   dst_ext=[mp3|ogg|...]     (required)\n"
-           "   pipeline=[gst pipeline]   (required)\n"
-           "   ncache=[0-9]*             (optional)\n",
+           "   src_ext=[mp3|ogg|...]     (required without pipeline.ext)\n"
+           "   dst_ext=[mp3|ogg|...]     (required without profiles)\n"
+           "   pipeline=[gst pipeline]   (required without profiles)\n"
+           "   pipeline.ext=[gst pipeline] (repeatable)\n"
+           "   profile=[name:ext:encoder] (repeatable)\n"
+           "   decoder=[gst pipeline]    (optional)\n"
+           "   decoder.ext=[gst pipeline] (repeatable)\n"
+           "   ncache=[0-9]*             (optional)\n"
+           "   cache_mb=[0-9]*           (optional)\n"
+           "   cache_dir=[directory]     (optional)\n"
+           "   npipelines=[0-9]*         (optional)\n"
+           "   size_index=[file]         (optional)\n"
+           "   bitrate=[kbit/s]          (optional)\n"
+           "   max_transcodes=[0-9]*     (optional)\n"
+           "   prefetch=[0-9]*           (optional)\n"
+           "   cache_policy=[lru|2q|arc|gdsf] (optional)\n"
+           "   path_ttl=[seconds]        (optional)\n"
+           "   spill_dir=[directory]     (optional)\n"
+           "   memfd                     (optional)\n"
+           "   shared_cache              (optional)\n"
+           "   pressure=[percent]        (optional)\n"
+           "   segments=[0-9]*           (optional)\n"
+           "   segment_secs=[seconds]    (optional)\n",
            prog);
 }
 
@@ -68,16 +139,45 @@ void usage(const char *prog)
 struct gstfs_file_info *get_file_info(const char *filename)
 {
     struct gstfs_file_info *fi;
+    struct source_info si;
+    const char *rel;
 
     fi = calloc(1, sizeof(struct gstfs_file_info));
     fi->filename = g_strdup(filename);
-    fi->src_filename = get_source_path(filename);
+    resolve_path(filename, &si);
+    fi->src_filename = si.path;
+    if (!si.error)
+    {
+        fi->src_mtime = si.stbuf.st_mtime;
+        fi->src_size = si.stbuf.st_size;
+        fi->src_ino = si.stbuf.st_ino;
+    }
+    fi->profile = split_profile(filename, &rel);
+    fi->pipeline = fi->profile->pipelines[max(source_type(si.path), 0)];
     /* Non zero size is needed to prevent 'cp' from using shortcut for copying
      * file by creating zero destination file without actually reading
      * anything
      */
     fi->len = -1;
     pthread_mutex_init(&fi->mutex, NULL);
+    pthread_cond_init(&fi->cond, NULL);
+    pthread_rwlock_init(&fi->buf_lock, NULL);
+
+    if (si.error)
+        fi->cache_key = NULL;
+    else if (mount_info.shared_cache && mount_info.cache_dir)
+        fi->cache_key = diskcache_content_key(&si.stbuf, fi->pipeline);
+    else if (mount_info.cache_dir || mount_info.size_index)
+        fi->cache_key = diskcache_key(fi->src_filename, &si.stbuf,
+            fi->pipeline);
+
+    /* whether a previous mount left it there is only looked at on use */
+    if (mount_info.cache_dir && fi->cache_key)
+        fi->cache_filename = diskcache_path(mount_info.cache_dir,
+            fi->cache_key);
+
+    if (fi->cache_key)
+        sizeindex_lookup(fi->cache_key, &fi->size_hint);
     return fi;
 }
 
@@ -88,118 +188,220 @@ void put_file_info(struct gstfs_file_info *fi)
 {
     g_free(fi->filename);
     g_free(fi->src_filename);
+    g_free(fi->cache_key);
+    g_free(fi->cache_filename);
+    segbuf_release(&fi->buf);
     free(fi);
 }
 
 /*
- *  Given a filename with extension "search", return a possibly reallocated
- *  string with "replace" on the end.
+ *  Return true if filename has the extension of profile p's files.
  */
-char *replace_ext(char *filename, char *search, char *replace)
+int is_target_type(const char *filename, const struct gstfs_profile *p)
 {
     char *ext = strrchr(filename, '.');
-    if (ext && strcmp(ext+1, search) == 0) 
+    return (ext && strcmp(ext+1, p->dst_ext) == 0);
+}
+
+/*
+ *  Find the profile whose subtree path is in, and set *rel to the path
+ *  below the profile's directory.  The root of a mount with several
+ *  profiles belongs to none of them: NULL is returned, with *rel set to
+ *  "/".  For paths outside of any profile, *rel is set to NULL.
+ */
+struct gstfs_profile *split_profile(const char *path, const char **rel)
+{
+    struct gstfs_profile *p = mount_info.profiles;
+    size_t len;
+    int i;
+
+    *rel = path;
+    if (!p->name)
+        return p;
+
+    if (!strcmp(path, "/"))
+        return NULL;
+
+    for (i = 0; i < mount_info.nprofiles; i++, p++)
     {
-        *(ext+1) = 0;
-        filename = g_strconcat(filename, replace, NULL);
+        len = strlen(p->name);
+        if (!strncmp(path + 1, p->name, len) &&
+            (!path[len + 1] || path[len + 1] == '/'))
+        {
+            *rel = path[len + 1] ? path + len + 1 : "/";
+            return p;
+        }
     }
-    return filename;
+    *rel = NULL;
+    return NULL;
 }
 
 /*
- *  Return true if filename has extension dst_ext.
+ *  Return the path in the mount of rel in profile p's subtree, to be
+ *  freed with g_free.
  */
-int is_target_type(const char *filename)
+char *profile_path(const struct gstfs_profile *p, const char *rel)
 {
-    char *ext = strrchr(filename, '.');
-    return (ext && strcmp(ext+1, mount_info.dst_ext) == 0);
+    if (!p->name)
+        return g_strdup(rel);
+    return g_strdup_printf("/%s%s", p->name, strcmp(rel, "/") ? rel : "");
 }
 
 /*
- * Moves file info structure to the tail of cache_lru
- *
- *  Called with cache_mutex held.
+ *  Look up the transcoded file path pinned, like cache_lookup with flags.
+ *  An entry made from an older version of the source, stbuf, is dropped
+ *  for a new one unless somebody is still using it.
  */
-void refresh_cache(struct gstfs_file_info *fi)
+static struct gstfs_file_info *lookup_current(const char *path,
+    const struct stat *stbuf, int flags)
 {
-    if (fi->list_node)
-        g_queue_unlink(mount_info.cache_lru, fi->list_node);
+    struct gstfs_file_info *fi;
 
-    g_queue_push_tail(mount_info.cache_lru, fi);
-    fi->list_node = mount_info.cache_lru->tail;
+    fi = cache_lookup(path, flags | CACHE_PIN);
+    if (!fi || (fi->src_mtime == stbuf->st_mtime &&
+                fi->src_size == stbuf->st_size &&
+                fi->src_ino == stbuf->st_ino))
+        return fi;
+
+    cache_unpin(fi);
+    if (cache_drop(fi))
+        stats_add(STATS_INVALIDATIONS, 1);
+    return cache_lookup(path, flags | CACHE_PIN);
 }
 
-/*  
- *  Remove items from the file cache until below the maximum.
- *  This is relatively quick since we can find elements by looking at the
- *  head of the lru list and then do a single hash lookup to remove from 
- *  the hash table.
+/*
+ *  If the path represents a file in the mirror filesystem, then
+ *  look for it in the cache.  If not, create a new file info.
+ *  flags are passed on to cache_lookup; the entry is always pinned.
  *
- *  Called with cache_mutex held.
+ *  If it isn't a mirror file, return NULL.
  */
-static void expire_cache()
+static struct gstfs_file_info *gstfs_lookup(const char *path, int flags)
 {
     struct gstfs_file_info *fi;
+    struct source_info si;
+
+    TRACE1(lookup, path);
+    resolve_path(path, &si);
+    g_free(si.path);
+    TRACE2(resolved, path, si.transcoded);
+
+    if (!si.transcoded)
+        return NULL;
+    fi = lookup_current(path, &si.stbuf, flags);
+    TRACE2(lookup_done, path, fi ? fi->complete : -1);
+    return fi;
+}
+
+/*
+ *  Lock info->mutex for a file system operation, with probes around the
+ *  wait for another opener or reader.
+ */
+static void lock_info(struct gstfs_file_info *info)
+{
+    TRACE1(info_lock, info->filename);
+    pthread_mutex_lock(&info->mutex);
+    TRACE1(info_locked, info->filename);
+}
+
+/*
+ *  Return true if the fuse option name was given on the command line,
+ *  as -oname[=value] or -o name[=value], possibly among others separated
+ *  by commas.
+ */
+static int has_fuse_opt(struct fuse_args *args, const char *name)
+{
+    const char *opts;
+    char **keys;
+    int i, j, found = 0;
 
-    while (g_queue_get_length(mount_info.cache_lru) > 
-           mount_info.max_cache_entries)
+    for (i = 1; i < args->argc && !found; i++)
     {
-        fi = (struct gstfs_file_info *) g_queue_pop_head(mount_info.cache_lru);
-        if (pthread_mutex_trylock(&fi->mutex) == EBUSY)
+        if (strncmp(args->argv[i], "-o", 2))
+            continue;
+        opts = args->argv[i][2] ? args->argv[i] + 2 : args->argv[++i];
+        if (!opts)
+            break;
+
+        keys = g_strsplit(opts, ",", -1);
+        for (j = 0; keys[j] && !found; j++)
         {
-            /* file is opened, move it to the end of cache lru */
-            refresh_cache(fi);
-        } else {
-            g_hash_table_remove(mount_info.file_cache, fi->filename);
-            pthread_mutex_unlock(&fi->mutex);
-            put_file_info(fi);
+            keys[j][strcspn(keys[j], "=")] = 0;
+            found = !strcmp(keys[j], name);
         }
+        g_strfreev(keys);
     }
+    return found;
 }
 
 /*
- *  If the path represents a file in the mirror filesystem, then
- *  look for it in the cache.  If not, create a new file info.
- *
- *  If it isn't a mirror file, return NULL.
+ *  Given a filename from the fuse mount, find the corresponding file in
+ *  the mirror and stat it, unless the path cache knows the answer.
+ *  si->path must be freed with g_free.
  */
-static struct gstfs_file_info *gstfs_lookup(const char *path)
+static void resolve_path(const char *filename, struct source_info *si)
 {
-    struct gstfs_file_info *ret;
-    char *source_path;
-
-    source_path = get_source_path(path);
+    struct gstfs_profile *p;
+    const char *rel;
+    char *source, *s;
+    int i;
+
+    /* the source itself stands in for what isn't in a profile */
+    p = split_profile(filename, &rel);
+    if (!rel)
+    {
+        si->path = g_strdup(mount_info.src_mnt);
+        si->error = ENOENT;
+        si->transcoded = 0;
+        return;
+    }
 
-    /*
-     * either the file is not to be transcoded or original is actually
-     * transcoded already
-     */
-    if (!is_target_type(path) || is_target_type(source_path))
+    if (pathcache_lookup(filename, si))
     {
-        g_free(source_path);
-        return NULL;
+        stats_add(STATS_PATH_HITS, 1);
+        return;
     }
+    stats_add(STATS_PATH_MISSES, 1);
 
-    pthread_mutex_lock(&mount_info.cache_mutex);
-    ret = g_hash_table_lookup(mount_info.file_cache, path);
-    if (!ret)
+    source = g_strdup_printf("%s%s", mount_info.src_mnt, rel);
+    si->error = stat(source, &si->stbuf) ? errno : 0;
+
+    /*
+     * if file exists in source directory we leave original extension,
+     * else the first source type with a file of that name stands in
+     */
+    if (si->error && p && is_target_type(source, p))
     {
-        ret = get_file_info(path);
-        if (!ret)
-            goto out;
+        int stem = strrchr(source, '.') - source;
 
-        g_hash_table_replace(mount_info.file_cache, ret->filename, ret);
+        for (i = 0; i < mount_info.nsrc_types && si->error; i++)
+        {
+            const char *ext = mount_info.src_types[i].ext;
+
+            if (!strcmp(ext, p->dst_ext))
+                continue;
+
+            s = g_strdup_printf("%.*s.%s", stem, source, ext);
+            if (stat(s, &si->stbuf))
+            {
+                g_free(s);
+                continue;
+            }
+            g_free(source);
+            source = s;
+            si->error = 0;
+        }
     }
+    si->path = source;
 
-    // move to end of LRU
-    refresh_cache(ret);
-
-    expire_cache();
+    /*
+     * either the file is not to be transcoded or original is actually
+     * transcoded already
+     */
+    si->transcoded = p && is_target_type(filename, p) &&
+        !is_target_type(source, p);
 
-out:
-    g_free(source_path);
-    pthread_mutex_unlock(&mount_info.cache_mutex);
-    return ret;
+    pathcache_store(filename, si);
 }
 
 /*
@@ -208,278 +410,1747 @@ out:
  */
 static char *get_source_path(const char *filename)
 {
-    char *source;
-    struct stat stbuf;
-
-    source = g_strdup_printf("%s%s", mount_info.src_mnt, filename);
-    /* if file exists in source directory we leave original extension */
-    if (stat(source, &stbuf))
-        source = replace_ext(source, mount_info.dst_ext, mount_info.src_ext);
-    return source;
-}
+    struct source_info si;
 
-static char *canonize(const char *cwd, const char *filename)
-{
-    if (filename[0] == '/')
-        return g_strdup(filename);
-    else
-        return g_strdup_printf("%s/%s", cwd, filename);
+    resolve_path(filename, &si);
+    return si.path;
 }
 
 int gstfs_statfs(const char *path, struct statvfs *buf)
 {
     char *source_path;
+    int ret = 0;
 
     source_path = get_source_path(path);
     if (statvfs(source_path, buf))
-        return -errno;
+        ret = -errno;
 
     g_free(source_path);
-    return 0;
+    return ret;
 }
 
-int gstfs_getattr(const char *path, struct stat *stbuf)
+/*
+ *  Return the size to report for a transcoded file: the exact size once
+ *  known, else a size from the index or the CBR estimator, else -1.
+ *
+ *  The estimator prerolls the source, so fi must be pinned.
+ */
+static off_t file_size(struct gstfs_file_info *fi)
 {
-    int ret = 0;
-    char *source_path;
-    struct gstfs_file_info *converted;
+    if (fi->complete)
+        return fi->len;
 
-    source_path = get_source_path(path);
+    if (!fi->size_hint && mount_info.bitrate && !fi->estimated)
+    {
+        long long duration = gstfs_source_duration(fi->src_filename);
 
-    if (stat(source_path, stbuf))
-        ret = -errno;
-    else if ((converted = gstfs_lookup(path)))
-        stbuf->st_size = converted->len;
+        /* bytes = seconds * kbit/s * 1000 / 8 */
+        if (duration > 0)
+            fi->size_hint = duration / 1000 * mount_info.bitrate / 8000;
+        fi->estimated = 1;
+    }
+    return fi->size_hint ? fi->size_hint : -1;
+}
 
-    g_free(source_path);
-    return ret;
+/*
+ *  Return the current contents of the stats file, to be freed with g_free.
+ */
+static char *get_stats(void)
+{
+    guint entries;
+    size_t bytes;
+
+    cache_usage(&entries, &bytes);
+    return stats_format(entries, bytes);
 }
 
-static int read_cb(char *buf, size_t size, void *data)
+/*
+ *  Fill in stbuf for a virtual file.  Returns -ENOENT if path isn't one.
+ */
+static int virtual_getattr(const char *path, struct stat *stbuf)
 {
-    struct gstfs_file_info *info = (struct gstfs_file_info *) data;
+    char *text;
 
-    size_t newsz = info->len + size;
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
 
-    if (info->alloc_len < newsz)
+    if (!strcmp(path, STATS_DIR))
     {
-        info->alloc_len = max(info->alloc_len * 2, newsz);
-        info->buf = realloc(info->buf, info->alloc_len);
-        if (!info->buf)
-            return -ENOMEM;
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        return 0;
     }
 
-    memcpy(&info->buf[info->len], buf, size);
-    info->len += size;
-    return 0;
+    if (!strcmp(path, STATS_FILE))
+    {
+        text = get_stats();
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = strlen(text);
+        g_free(text);
+        return 0;
+    }
+    return -ENOENT;
 }
 
-/*
- * Reads part of file from source mountpoint
- *
- */
-int gstfs_read_srcfile(const char *path, char *buf, size_t size, off_t offset)
+int gstfs_getattr(const char *path, struct stat *stbuf)
 {
-    int fd;
-    int readsize = -EINVAL;
+    struct source_info si;
+    struct gstfs_file_info *converted;
 
-    fd = open(path, O_RDONLY);
-    if (fd == -1)
-        return -EBADF;
+    if (!virtual_getattr(path, stbuf))
+        return 0;
+
+    resolve_path(path, &si);
+    g_free(si.path);
+    if (si.error)
+        return -si.error;
 
-    if(lseek(fd, offset, SEEK_SET) == offset)
+    *stbuf = si.stbuf;
+    if (si.transcoded && (converted = lookup_current(path, &si.stbuf, 0)))
     {
-        readsize = read(fd, buf, size);
-        if (readsize == -1)
-            readsize = -errno;
+        stbuf->st_size = converted->reported_size = file_size(converted);
+        cache_unpin(converted);
     }
-
-    close(fd);
-    return readsize;
+    return 0;
 }
 
-int gstfs_read(const char *path, char *buf, size_t size, off_t offset, 
-    struct fuse_file_info *fi)
+/*
+ *  Append transcoded data to the file.  Only the transcode thread changes
+ *  len and buf while transcoding, so the copy itself needs no lock: readers
+ *  never look past len, which is published afterwards.
+ */
+static int read_cb(char *buf, size_t size, void *data)
 {
-    struct gstfs_file_info *info = gstfs_lookup(path);
-    size_t count = -EINVAL;
+    struct gstfs_file_info *info = (struct gstfs_file_info *) data;
+    size_t newsz = info->len + size;
+    int ret;
 
-    if (!info)
+    if (!info->len && size)
+        stats_time(STATS_FIRST_BUFFER,
+            g_get_monotonic_time() - info->transcode_start);
+
+    if (info->alloc_len < newsz)
     {
-        char *source_path;
-        source_path = get_source_path(path);
-        count = gstfs_read_srcfile(source_path, buf, size, offset);
-        g_free(source_path);
-        return count;
-    }
+        size_t alloc_len;
 
-    pthread_mutex_lock(&info->mutex);
+        /* a file that alone exceeds the cache budget is refused */
+        if (mount_info.max_cache_bytes && newsz > mount_info.max_cache_bytes)
+            return -EFBIG;
 
-    if (info->len <= offset)
-        goto out;
+        pthread_rwlock_wrlock(&info->buf_lock);
+        ret = segbuf_reserve(&info->buf, newsz);
+        alloc_len = segbuf_alloc_len(&info->buf);
+        pthread_rwlock_unlock(&info->buf_lock);
 
-    count = min(info->len - offset, size);
+        cache_account(alloc_len - info->alloc_len);
+        info->alloc_len = alloc_len;
+        if (ret)
+            return ret;
+    }
 
-    memcpy(buf, &info->buf[offset], count);
+    segbuf_write(&info->buf, info->len, buf, size);
 
-out:
+    /* wake up readers waiting for this part of the file */
+    pthread_mutex_lock(&info->mutex);
+    info->len = newsz;
+    pthread_cond_broadcast(&info->cond);
     pthread_mutex_unlock(&info->mutex);
-    return count;
+    return 0;
 }
 
 /*
- * Tries to open given file (expected to be from source mountpoint)
+ *  Write a completed file to its cache_dir entry.
  *
+ *  Called with transcoding still set, so buf can't be expired under us.
  */
-int gstfs_open_srcfile(const char *path)
+static void store_disk_cache(struct gstfs_file_info *info)
 {
-    struct stat stbuf;
-    int ret = 0;
-    int fd;
+    char *tmp_path;
+    size_t i, offset;
+    int fd, ret = 0;
 
-    if (stat(path, &stbuf))
-        ret = -ENOENT;
+    fd = diskcache_create(info->cache_filename, &tmp_path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "gstfs: cache_dir: %s\n", strerror(-fd));
+        return;
+    }
 
-    fd = open(path, O_RDONLY);
-    if (fd != -1)
-        close(fd);
+    for (i = 0, offset = 0; !ret && offset < info->len; i++)
+    {
+        size_t count = min(info->len - offset, SEGBUF_SEGMENT_SIZE);
+
+        ret = diskcache_write(fd, info->buf.segs[i], count);
+        offset += count;
+    }
+    if (ret)
+        diskcache_abort(fd, tmp_path);
     else
-        ret = -errno;
-    return ret;
-}
+        ret = diskcache_commit(fd, tmp_path, info->cache_filename);
 
+    if (ret)
+        fprintf(stderr, "gstfs: cache_dir: %s\n", strerror(-ret));
+}
 
-int gstfs_open(const char *path, struct fuse_file_info *fi)
+/*
+ *  Return the bytes per second of output, if the output has a constant
+ *  bitrate, else 0.
+ */
+static size_t output_rate(void)
 {
-    struct gstfs_file_info *info = gstfs_lookup(path);
-
-    if (!info)
-    {
-        char *source_path;
-        int ret;
-        source_path = get_source_path(path);
-        ret = gstfs_open_srcfile(source_path);
-        g_free(source_path);
-        return ret;
-    }
+    return (size_t) mount_info.bitrate * 1000 / 8;
+}
 
-    pthread_mutex_lock(&info->mutex);
+static void free_seek(struct seek_fill *fill)
+{
+    cache_account(-(ssize_t) fill->alloc_len);
+    segbuf_release(&fill->buf);
+    g_free(fill);
+}
 
-    if (!info->buf)
-    {
-        /* resetting length to 0 so that transcode appends from beginning */
-        info->len = 0;
-        gstfs_transcode(mount_info.pipeline, info->src_filename, read_cb, info);
-    }
+/*
+ *  Forget info's seek fill.  It is freed once its transcode returned.
+ *
+ *  Called with info->mutex held.
+ */
+static void drop_seek(struct gstfs_file_info *info)
+{
+    struct seek_fill *fill = info->seek;
 
-    pthread_mutex_unlock(&info->mutex);
+    if (!fill)
+        return;
 
-    return 0;
+    info->seek = NULL;
+    fill->cancelled = 1;
+    pthread_cond_broadcast(&info->cond);
+    if (!fill->running)
+        free_seek(fill);
 }
 
 /*
- *  Copy all entries from source mount, replacing extensions along the way.
+ *  Append output to a seek fill, keeping it at most SEEK_WINDOW_SECS ahead
+ *  of its reader.  Gives up once the fill was dropped or the transcode of
+ *  the whole file caught up with it.
  */
-int gstfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-    off_t offset, struct fuse_file_info *fi)
+static int seek_cb(char *buf, size_t size, void *data)
 {
-    struct dirent *dirent;
-    DIR *dir;
-    char *source_path;
+    struct seek_fill *fill = (struct seek_fill *) data;
+    struct gstfs_file_info *info = fill->info;
+    size_t newsz = fill->len + size;
+    int ret = 0;
 
-    source_path = get_source_path(path);
-    dir = opendir(source_path);
+    pthread_mutex_lock(&info->mutex);
+    for (;;)
+    {
+        if (fill->cancelled || !info->transcoding ||
+            info->len >= fill->start + fill->len)
+        {
+            ret = -ECANCELED;
+            break;
+        }
+        if (fill->len < fill->wanted + SEEK_WINDOW_SECS * output_rate())
+            break;
+        pthread_cond_wait(&info->cond, &info->mutex);
+    }
 
-    if (!dir)
-        return -ENOENT;
+    if (!ret && mount_info.max_cache_bytes &&
+        newsz > mount_info.max_cache_bytes)
+        ret = -EFBIG;
 
-    while ((dirent = readdir(dir)))
+    if (!ret && fill->alloc_len < newsz)
     {
-        char *s = g_strdup(dirent->d_name);
-        s = replace_ext(s, mount_info.src_ext, mount_info.dst_ext);
-        filler(buf, s, NULL, 0);
-
-        g_free(s);
+        ret = segbuf_reserve(&fill->buf, newsz);
+        cache_account(segbuf_alloc_len(&fill->buf) - fill->alloc_len);
+        fill->alloc_len = segbuf_alloc_len(&fill->buf);
     }
-    closedir(dir);
 
-    return 0;
+    if (!ret)
+    {
+        segbuf_write(&fill->buf, fill->len, buf, size);
+        fill->len = newsz;
+        pthread_cond_broadcast(&info->cond);
+    }
+    pthread_mutex_unlock(&info->mutex);
+    return ret;
 }
 
-int gstfs_access(const char *path, int mode)
+static void *seek_thread(void *data)
 {
-    char *source_path;
-    int ret;
-
-    source_path = get_source_path(path);
-    ret = access(source_path, mode);
-    g_free(source_path);
-    return ret;
-}
+    struct seek_fill *fill = (struct seek_fill *) data;
+    struct gstfs_file_info *info = fill->info;
 
-static struct fuse_operations gstfs_opers = {
-    .access = gstfs_access,
-    .readdir = gstfs_readdir,
-    .statfs = gstfs_statfs,
-    .getattr = gstfs_getattr,
-    .open = gstfs_open,
-    .read = gstfs_read
-};
+    gstfs_transcode_range(info->pipeline, info->src_filename,
+        (long long) (fill->start / output_rate()) * GST_SECOND, -1,
+        SEGMENT_MARGIN, seek_cb, fill);
+    sched_put_slots(1);
 
-static struct fuse_opt gstfs_opts[] = {
-    GSTFS_OPT_KEY("src=%s", src_mnt, 0),
-    GSTFS_OPT_KEY("src_ext=%s", src_ext, 0),
-    GSTFS_OPT_KEY("dst_ext=%s", dst_ext, 0),
-    GSTFS_OPT_KEY("ncache=%d", max_cache_entries, 0),
-    GSTFS_OPT_KEY("pipeline=%s", pipeline, 0),
-    FUSE_OPT_END
-};
+    pthread_mutex_lock(&info->mutex);
+    fill->running = 0;
+    if (fill->cancelled)
+        free_seek(fill);
+    pthread_cond_broadcast(&info->cond);
+    pthread_mutex_unlock(&info->mutex);
 
+    cache_unpin(info);
+    return NULL;
+}
 
-int main(int argc, char *argv[])
+/*
+ *  Find out where the output of info's seek fill goes in the file, once
+ *  the transcode of the whole file got past the fill's estimated start:
+ *  SEEK_PROBE_LEN bytes of the file from SEEK_PROBE_SLACK after it are
+ *  looked for in the fill, which is moved to where they match.  Its data
+ *  before the match is never served, and all the file has beyond must
+ *  be the same.
+ *
+ *  Returns 1 once the fill is in place, 0 if the file isn't far enough
+ *  yet, or -1 if the fill doesn't match, in which case it is dropped.
+ *
+ *  Called with info->mutex held.
+ */
+static int reconcile_seek(struct gstfs_file_info *info)
 {
-    char pwd[2048];
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    struct stat stbuf;
-
-    if (fuse_opt_parse(&args, &mount_info, gstfs_opts, NULL) == -1)
-        return -1;
+    struct seek_fill *fill = info->seek;
+    size_t probe = fill->start + SEEK_PROBE_SLACK;
+    size_t window = 2 * SEEK_PROBE_SLACK + SEEK_PROBE_LEN;
+    size_t at, overlap;
+    char *data, *file, *found;
+    int ret = 1;
+
+    if (fill->reconciled)
+        return 1;
+    if (info->len < probe + SEEK_PROBE_LEN || fill->len < window)
+        return 0;
+
+    data = g_malloc(window);
+    file = g_malloc(SEEK_PROBE_LEN);
+    segbuf_read(&fill->buf, 0, data, window);
+    pthread_rwlock_rdlock(&info->buf_lock);
+    segbuf_read(&info->buf, probe, file, SEEK_PROBE_LEN);
+    pthread_rwlock_unlock(&info->buf_lock);
+
+    found = memmem(data, window, file, SEEK_PROBE_LEN);
+    at = found ? found - data : 0;
+    if (!found || at > probe)
+        ret = -1;
+    g_free(data);
+    g_free(file);
+
+    /* the fill's byte at is the file's at probe, check what follows */
+    overlap = ret > 0 ? min(info->len - probe, fill->len - at) : 0;
+    if (overlap)
+    {
+        data = g_malloc(overlap);
+        file = g_malloc(overlap);
+        segbuf_read(&fill->buf, at, data, overlap);
+        pthread_rwlock_rdlock(&info->buf_lock);
+        segbuf_read(&info->buf, probe, file, overlap);
+        pthread_rwlock_unlock(&info->buf_lock);
+        if (memcmp(data, file, overlap))
+            ret = -1;
+        g_free(data);
+        g_free(file);
+    }
 
-    if (!mount_info.src_mnt ||
-        !mount_info.src_ext ||
-        !mount_info.dst_ext ||
-        !mount_info.pipeline)
+    if (ret < 0)
     {
-        usage(argv[0]);
+        /* this output can't be resumed from a seek, so don't start more */
+        info->seek_mismatch = 1;
+        drop_seek(info);
         return -1;
     }
 
-    if (!getcwd(pwd, sizeof(pwd)))
+    fill->start = probe - at;
+    fill->skip = at;
+    fill->reconciled = 1;
+    return 1;
+}
+
+/*
+ *  Serve a read at offset far ahead of the transcode of info from a seek
+ *  fill: a transcode started where the constant bitrate puts offset in
+ *  the source.  A fill is started if there is none near offset and a
+ *  scheduler slot is free, as it runs a pipeline of its own.  As that
+ *  is only an estimate, its data is only served once reconcile_seek put
+ *  it in place, so that reads see the same bytes the file ends up with.
+ *
+ *  Returns the number of bytes read, or 0 if the caller is to wait.
+ *
+ *  Called with info->mutex held.
+ */
+static ssize_t read_seek(struct gstfs_file_info *info, char *buf,
+    size_t size, off_t offset)
+{
+    struct seek_fill *fill = info->seek;
+    size_t rate = output_rate(), count, pos = offset;
+    pthread_t thread;
+
+    if (!rate || pos >= info->size_hint)
+        return 0;
+
+    /* the whole file has caught up with it */
+    if (fill && info->len >= fill->start + fill->len)
     {
-        perror("gstfs");
-        return -1;
+        drop_seek(info);
+        fill = NULL;
     }
 
-    mount_info.src_mnt = canonize(pwd, mount_info.src_mnt);
-    if (stat(mount_info.src_mnt, &stbuf) == -1)
+    if (fill && reconcile_seek(info) < 0)
+        fill = NULL;
+
+    if (fill && fill->reconciled && pos >= fill->start + fill->skip &&
+        pos < fill->start + fill->len)
     {
-        perror("gstfs: source directory:");
-        return -1;
+        count = min(fill->start + fill->len - pos, size);
+        segbuf_read(&fill->buf, pos - fill->start, buf, count);
+        fill->wanted = max(fill->wanted, pos - fill->start + count);
+        pthread_cond_broadcast(&info->cond);
+        return count;
     }
 
-    if(!S_ISDIR(stbuf.st_mode))
+    /* near enough to wait for one of the transcodes */
+    if (pos < info->len + SEEK_DISTANCE_SECS * rate || info->seek_mismatch)
+        return 0;
+    if (fill && pos >= fill->start &&
+        pos < fill->start + fill->len + SEEK_DISTANCE_SECS * rate)
     {
-        fprintf(stderr, "gstfs: source path is not directory\n");
-        return -1;
+        fill->wanted = max(fill->wanted, pos - fill->start);
+        pthread_cond_broadcast(&info->cond);
+        return 0;
     }
 
-    if (mount_info.max_cache_entries == 0)
-        mount_info.max_cache_entries = 50;
+    /* it is one more pipeline, so only start it if a slot is free */
+    if (!sched_take_slots(1))
+        return 0;
 
-    pthread_mutex_init(&mount_info.cache_mutex, NULL);
-    mount_info.file_cache = g_hash_table_new(g_str_hash, g_str_equal);
-    mount_info.cache_lru = g_queue_new();
+    drop_seek(info);
+    fill = g_new0(struct seek_fill, 1);
+    fill->info = info;
+    fill->start = pos / rate * rate;
+    fill->wanted = pos - fill->start;
+    fill->running = 1;
+
+    /* the reader's pin may go away before the fill's transcode returns */
+    cache_lookup(info->filename, CACHE_PIN | CACHE_PEEK);
+    if (pthread_create(&thread, NULL, seek_thread, fill))
+    {
+        g_free(fill);
+        cache_unpin(info);
+        sched_put_slots(1);
+        return 0;
+    }
+    pthread_detach(thread);
+    info->seek = fill;
+    stats_add(STATS_SEEKS, 1);
+    return 0;
+}
+
+/*
+ *  Remember that the transcode of info failed with ret, so that it isn't
+ *  tried again for a while unless the source changes.
+ */
+static void record_failure(struct gstfs_file_info *info, int ret)
+{
+    struct stat stbuf;
+    gint64 backoff;
+
+    /* anything that isn't an errno is the pipeline's fault */
+    if (ret >= -2)
+        ret = -EIO;
+
+    pthread_mutex_lock(&info->mutex);
+    info->error = ret;
+    if (!stat(info->src_filename, &stbuf))
+    {
+        info->failed_mtime = stbuf.st_mtime;
+        info->failed_size = stbuf.st_size;
+    }
+    backoff = (gint64) FAIL_BACKOFF_SECS << min(info->failures, 16);
+    info->retry_after = g_get_monotonic_time() +
+        min(backoff, FAIL_BACKOFF_MAX) * G_USEC_PER_SEC;
+    info->failures++;
+    pthread_mutex_unlock(&info->mutex);
+
+    fprintf(stderr, "gstfs: transcode of %s failed: %s\n",
+        info->src_filename, strerror(-ret));
+}
+
+/*
+ *  Return true if the last transcode of info failed and it isn't time to
+ *  try again yet: the backoff hasn't run out and the source is unchanged.
+ *
+ *  Called with info->mutex held.
+ */
+static int failed_recently(struct gstfs_file_info *info)
+{
+    struct stat stbuf;
+
+    if (!info->error)
+        return 0;
+
+    if (g_get_monotonic_time() < info->retry_after &&
+        !stat(info->src_filename, &stbuf) &&
+        stbuf.st_mtime == info->failed_mtime &&
+        stbuf.st_size == info->failed_size)
+        return 1;
+
+    info->error = 0;
+    return 0;
+}
+
+/*
+ *  Publish the outcome of a transcode of info that returned ret.  Readers
+ *  are woken once the file is complete or the transcode gave up.
+ */
+static void finish_transcode(struct gstfs_file_info *info, int ret)
+{
+    stats_time(STATS_TRANSCODE, info->transcode_usecs);
+
+    pthread_mutex_lock(&info->mutex);
+    g_atomic_int_set(&info->complete, ret == 0 && info->buf.nsegs);
+    drop_seek(info);
+    if (!info->complete)
+    {
+        /* don't hold on to the partial output of a failed transcode */
+        cache_account(-(ssize_t) info->alloc_len);
+        pthread_rwlock_wrlock(&info->buf_lock);
+        segbuf_release(&info->buf);
+        pthread_rwlock_unlock(&info->buf_lock);
+        info->alloc_len = 0;
+        info->len = 0;
+    }
+    pthread_cond_broadcast(&info->cond);
+    pthread_mutex_unlock(&info->mutex);
+
+    if (info->complete && info->cache_filename && !info->on_disk)
+        store_disk_cache(info);
+
+    if (info->complete && info->cache_key)
+        sizeindex_store(info->cache_key, info->len);
+
+    /* before anybody may start it again */
+    if (!info->complete)
+        record_failure(info, ret);
+    else
+        info->failures = 0;
+
+    pthread_mutex_lock(&info->mutex);
+    info->transcoding = 0;
+    pthread_cond_broadcast(&info->cond);
+    pthread_mutex_unlock(&info->mutex);
+
+    stats_add(STATS_TRANSCODES_RUNNING, -1);
+    stats_add(info->complete ? STATS_TRANSCODES_DONE :
+        STATS_TRANSCODES_FAILED, 1);
+
+    /*
+     * Nobody opened a prefetched file yet, so it would sit at the cold
+     * end and go first; count its transcode as a use instead.
+     */
+    if (info->complete && info->sched_prio == SCHED_BACKGROUND &&
+        !info->hits)
+        cache_lookup(info->filename, CACHE_TOUCH | CACHE_PEEK);
+
+    /* the entry can be evicted now, if the cache is over budget */
+    cache_update(info);
+}
+
+/*
+ *  Take the output of a part of a segmented transcode.  Parts after the
+ *  first are kept aside, counted against the cache budget, until all
+ *  before them are in the file.
+ */
+static int segment_cb(char *buf, size_t size, void *data)
+{
+    struct xcode_segment *seg = (struct xcode_segment *) data;
+    size_t newsz = seg->len + size;
+    int ret = 0;
+
+    pthread_mutex_lock(&seg->mutex);
+    if (seg->cancelled)
+        ret = -ECANCELED;
+    else if (seg->direct)
+        ret = read_cb(buf, size, seg->info);
+    else if (mount_info.max_cache_bytes &&
+        newsz > mount_info.max_cache_bytes)
+        ret = -EFBIG;
+    else
+    {
+        if (seg->alloc_len < newsz)
+        {
+            ret = segbuf_reserve(&seg->buf, newsz);
+            cache_account(segbuf_alloc_len(&seg->buf) - seg->alloc_len);
+            seg->alloc_len = segbuf_alloc_len(&seg->buf);
+        }
+        if (!ret)
+        {
+            segbuf_write(&seg->buf, seg->len, buf, size);
+            seg->len = newsz;
+        }
+    }
+    pthread_mutex_unlock(&seg->mutex);
+    return ret;
+}
+
+/*
+ *  Append the output seg kept aside to its file, unless ret says the file
+ *  failed already, and free it.  Returns ret, or the error of appending.
+ *
+ *  Called with seg->mutex held.
+ */
+static int flush_segment(struct xcode_segment *seg, int ret)
+{
+    size_t i, offset;
+
+    for (i = 0, offset = 0; !ret && offset < seg->len; i++)
+    {
+        size_t count = min(seg->len - offset, SEGBUF_SEGMENT_SIZE);
+
+        ret = read_cb(seg->buf.segs[i], count, seg->info);
+        offset += count;
+    }
+
+    cache_account(-(ssize_t) seg->alloc_len);
+    segbuf_release(&seg->buf);
+    seg->alloc_len = 0;
+    seg->len = 0;
+    return ret;
+}
+
+static void *segment_thread(void *data)
+{
+    struct xcode_segment *seg = (struct xcode_segment *) data;
+
+    seg->ret = gstfs_transcode_range(seg->info->pipeline,
+        seg->info->src_filename, seg->start, seg->stop, SEGMENT_MARGIN,
+        segment_cb, seg);
+    return NULL;
+}
+
+/*
+ *  Transcode nsegs parts of info at once, each in its own pipeline that
+ *  seeks to its part of the source.  The first part is appended to the
+ *  file as it comes, like any transcode.  Once a part is done, the output
+ *  of the next one is appended and it goes on appending directly.
+ *
+ *  The job itself holds a scheduler slot for the first part; the others
+ *  only run at once as far as they get slots no other job uses, so that
+ *  no more than max_transcodes pipelines run.
+ */
+static int transcode_segmented(struct gstfs_file_info *info,
+    long long duration, int nsegs)
+{
+    struct xcode_segment *segs;
+    pthread_t *threads;
+    int *started;
+    int i, j, ret, slots;
+
+    segs = g_new0(struct xcode_segment, nsegs);
+    threads = g_new(pthread_t, nsegs);
+    started = g_new0(int, nsegs);
+    for (i = 0; i < nsegs; i++)
+    {
+        segs[i].info = info;
+        segs[i].start = duration * i / nsegs;
+        segs[i].stop = i == nsegs - 1 ? -1 : duration * (i + 1) / nsegs;
+        segs[i].direct = (i == 0);
+        pthread_mutex_init(&segs[i].mutex, NULL);
+    }
+
+    /* parts without a slot or whose thread didn't start are run in turn */
+    slots = sched_take_slots(nsegs - 1);
+    for (i = 1; i <= slots; i++)
+    {
+        started[i] = !pthread_create(&threads[i], NULL, segment_thread,
+            &segs[i]);
+        if (!started[i])
+            sched_put_slots(1);
+    }
+
+    segment_thread(&segs[0]);
+    ret = segs[0].ret;
+    for (i = 1; i < nsegs; i++)
+    {
+        pthread_mutex_lock(&segs[i].mutex);
+        ret = flush_segment(&segs[i], ret);
+        segs[i].direct = !ret;
+        pthread_mutex_unlock(&segs[i].mutex);
+
+        /* stop the parts still running, the file failed anyway */
+        for (j = i; ret && j < nsegs; j++)
+        {
+            pthread_mutex_lock(&segs[j].mutex);
+            segs[j].cancelled = 1;
+            pthread_mutex_unlock(&segs[j].mutex);
+        }
+
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+            sched_put_slots(1);
+        }
+        else if (!ret)
+            segment_thread(&segs[i]);
+        if (!ret)
+            ret = segs[i].ret;
+    }
+
+    /* output a part kept aside before it was cancelled */
+    for (i = 0; i < nsegs; i++)
+    {
+        flush_segment(&segs[i], -ECANCELED);
+        pthread_mutex_destroy(&segs[i].mutex);
+    }
+    g_free(segs);
+    g_free(threads);
+    g_free(started);
+    return ret;
+}
+
+/*
+ *  Transcode info, in parts at once if segments is set and the source is
+ *  long enough.
+ */
+static int transcode_one(struct gstfs_file_info *info)
+{
+    long long duration, part = (long long) mount_info.segment_secs *
+        GST_SECOND;
+    int nsegs = 1;
+
+    if (mount_info.segments > 1)
+    {
+        duration = gstfs_source_duration(info->src_filename);
+        if (duration > 0)
+            nsegs = min(mount_info.segments, duration / part);
+        if (nsegs > 1)
+            return transcode_segmented(info, duration, nsegs);
+    }
+    return gstfs_transcode(info->pipeline, info->src_filename,
+        read_cb, info);
+}
+
+/*
+ *  With a shared cache_dir, take the lease on producing the entry of
+ *  info, so that other hosts wait for it instead of transcoding it too.
+ *  Returns 1 if the entry exists by now, -EBUSY if another host holds
+ *  the lease and wait is false, else 0, with info->lease set if taken.
+ */
+static int claim_shared(struct gstfs_file_info *info, int wait)
+{
+    int ret;
+
+    info->lease = 0;
+    if (!mount_info.shared_cache || !info->cache_filename)
+        return 0;
+
+    ret = diskcache_claim(info->cache_filename, wait, NULL);
+    if (ret < 0 && ret != -EBUSY)
+    {
+        /* transcode anyway, at worst twice */
+        fprintf(stderr, "gstfs: cache_dir lease: %s\n", strerror(-ret));
+        ret = 0;
+    }
+    else
+        info->lease = !ret;
+    return ret;
+}
+
+/*
+ *  Load the entry another host put into the shared cache_dir for info,
+ *  in place of transcoding it.
+ */
+static void fetch_shared(struct gstfs_file_info *info)
+{
+    gint64 start = g_get_monotonic_time();
+    char *buf;
+    ssize_t n = 0;
+    int fd, ret = 0;
+
+    info->transcode_start = start;
+    stats_add(STATS_TRANSCODES_RUNNING, 1);
+    stats_add(STATS_SHARED_FETCHES, 1);
+
+    fd = open(info->cache_filename, O_RDONLY);
+    if (fd == -1)
+        ret = -errno;
+    else
+    {
+        buf = g_malloc(FETCH_CHUNK);
+        while (!ret && (n = read(fd, buf, FETCH_CHUNK)) > 0)
+            ret = read_cb(buf, n, info);
+        if (n == -1 && !ret)
+            ret = -errno;
+        g_free(buf);
+        close(fd);
+    }
+
+    /* it stays on disk, so don't write it again */
+    if (!ret)
+    {
+        pthread_mutex_lock(&info->mutex);
+        info->on_disk = 1;
+        pthread_mutex_unlock(&info->mutex);
+    }
+
+    info->transcode_usecs = g_get_monotonic_time() - start;
+    finish_transcode(info, ret);
+}
+
+/*
+ *  Collect the files the other profiles show for the source of info,
+ *  whose transcodes are still waiting to be run, so that they can share
+ *  the decode of info's.  group is indexed by profile and gets info
+ *  itself too; the others are taken off the queue and pinned.
+ */
+static void group_profiles(struct gstfs_file_info *info,
+    struct gstfs_file_info **group)
+{
+    struct gstfs_file_info *fi;
+    const char *rel;
+    char *path;
+    int i;
+
+    split_profile(info->filename, &rel);
+    for (i = 0; i < mount_info.nprofiles; i++)
+    {
+        group[i] = NULL;
+        if (&mount_info.profiles[i] == info->profile)
+        {
+            group[i] = info;
+            continue;
+        }
+
+        path = profile_path(&mount_info.profiles[i], rel);
+        fi = cache_lookup(path, CACHE_PIN | CACHE_PEEK);
+        g_free(path);
+        if (!fi)
+            continue;
+
+        if (strcmp(fi->src_filename, info->src_filename) || !sched_steal(fi))
+        {
+            cache_unpin(fi);
+            continue;
+        }
+
+        /* one another host is on goes back to wait in its own job */
+        if (claim_shared(fi, 0))
+        {
+            sched_submit(fi, fi->sched_prio);
+            cache_unpin(fi);
+            continue;
+        }
+        group[i] = fi;
+    }
+}
+
+/*
+ *  Return a pipeline decoding the source once and encoding it for each
+ *  profile in group through a tee, into appsinks _dest0, _dest1, ... in
+ *  profile order.  The string is interned, as the pipeline pool needs it
+ *  to stay around.
+ */
+static char *tee_pipeline(struct gstfs_file_info **group,
+    const char *src_filename)
+{
+    struct gstfs_source_type *t;
+    const char *pipeline;
+    GString *s;
+    int i, n = 0;
+
+    t = &mount_info.src_types[max(source_type(src_filename), 0)];
+    s = g_string_new(t->decoder ? t->decoder : mount_info.decoder);
+    g_string_append(s, " ! tee name=_tee");
+    for (i = 0; i < mount_info.nprofiles; i++)
+    {
+        if (group[i])
+            g_string_append_printf(s, " _tee. ! queue ! %s ! "
+                "appsink name=_dest%d sync=false",
+                mount_info.profiles[i].encoder, n++);
+    }
+    pipeline = g_intern_string(s->str);
+    g_string_free(s, TRUE);
+    return (char *) pipeline;
+}
+
+/*
+ *  Runs a transcode on a scheduler worker, appending to the file info
+ *  through read_cb.  Files that other profiles show for the same source
+ *  and are waiting to be transcoded too are encoded from the same decode.
+ */
+static void transcode_file(struct gstfs_file_info *info)
+{
+    struct gstfs_file_info **group, **files;
+    gint64 start, usecs;
+    int *rets;
+    int i, n;
+
+    TRACE1(job_start, info->filename);
+
+    /* another host may be at it, or even done by now */
+    if (claim_shared(info, 1) == 1)
+    {
+        fetch_shared(info);
+        TRACE3(job_done, info->filename, info->len, info->error);
+        cache_kick();
+        return;
+    }
+
+    group = g_new(struct gstfs_file_info *, mount_info.nprofiles);
+    files = g_new(struct gstfs_file_info *, mount_info.nprofiles);
+    rets = g_new(int, mount_info.nprofiles);
+    group_profiles(info, group);
+
+    start = g_get_monotonic_time();
+    for (i = 0, n = 0; i < mount_info.nprofiles; i++)
+    {
+        if (!group[i])
+            continue;
+        files[n++] = group[i];
+        group[i]->transcode_start = start;
+        stats_add(STATS_TRANSCODES_RUNNING, 1);
+    }
+
+    if (n == 1)
+        rets[0] = transcode_one(info);
+    else
+    {
+        stats_add(STATS_TRANSCODES_SHARED, n - 1);
+        gstfs_transcode_tee(tee_pipeline(group, info->src_filename),
+            info->src_filename, n, read_cb, (void **) files, rets);
+    }
+    usecs = g_get_monotonic_time() - start;
+
+    for (i = 0; i < n; i++)
+    {
+        files[i]->transcode_usecs = usecs;
+        finish_transcode(files[i], rets[i]);
+        TRACE3(job_done, files[i]->filename, files[i]->len, files[i]->error);
+        if (files[i]->lease)
+            diskcache_release(files[i]->cache_filename);
+        if (files[i] != info)
+            cache_unpin(files[i]);
+    }
+    cache_kick();
+
+    g_free(group);
+    g_free(files);
+    g_free(rets);
+}
+
+/*
+ *  The first time info is about to be used, see whether a previous mount
+ *  left it in cache_dir.
+ *
+ *  Called with info->mutex held.
+ */
+static void check_disk_cache(struct gstfs_file_info *info)
+{
+    struct stat stbuf;
+
+    if (info->disk_checked)
+        return;
+    info->disk_checked = 1;
+
+    if (info->cache_filename && !info->complete && !info->transcoding &&
+        !stat(info->cache_filename, &stbuf))
+    {
+        info->len = stbuf.st_size;
+        info->complete = 1;
+        info->on_disk = 1;
+    }
+}
+
+/*
+ *  Queue a transcode of info unless it is complete or already on its way,
+ *  in which case the caller joins that job.  A job still waiting is moved
+ *  up to prio.
+ *
+ *  Returns the error of the last transcode if it failed recently, else 0.
+ *
+ *  Called with info->mutex held.
+ */
+static int start_transcode(struct gstfs_file_info *info, int prio)
+{
+    check_disk_cache(info);
+    if (info->complete)
+        return 0;
+
+    if (info->transcoding)
+    {
+        sched_promote(info, prio);
+        return 0;
+    }
+
+    if (failed_recently(info))
+        return info->error;
+
+    /* resetting length to 0 so that transcode appends from beginning */
+    info->len = 0;
+    info->transcoding = 1;
+    sched_submit(info, prio);
+    return 0;
+}
+
+int gstfs_read(const char *path, char *buf, size_t size, off_t offset, 
+    struct fuse_file_info *fi)
+{
+    struct gstfs_handle *fh = (struct gstfs_handle *) (uintptr_t) fi->fh;
+    struct gstfs_file_info *info = fh->info;
+    ssize_t count = -EINVAL;
+    size_t len;
+
+    if (fh->text)
+    {
+        if (fh->text_len <= offset)
+            return 0;
+
+        count = min(fh->text_len - offset, size);
+        memcpy(buf, fh->text + offset, count);
+        return count;
+    }
+
+    /* passthrough files and cache_dir hits are read from their fd */
+    if (fh->fd != -1)
+    {
+        count = pread(fh->fd, buf, size, offset);
+        if (count == -1)
+            return -errno;
+
+        stats_add(info ? STATS_BYTES_DISK : STATS_BYTES_PASSTHROUGH, count);
+        return count;
+    }
+
+    /* a complete file never changes, so copy it without any lock */
+    if (g_atomic_int_get(&info->complete))
+    {
+        if (info->len <= offset)
+            return 0;
+
+        count = min(info->len - offset, size);
+        segbuf_read(&info->buf, offset, buf, count);
+        stats_add(STATS_BYTES_MEMORY, count);
+        return count;
+    }
+
+    lock_info(info);
+
+    /* streaming: block until the transcode has produced this offset */
+    while (info->transcoding && !info->complete && info->len <= offset)
+    {
+        if ((count = read_seek(info, buf, size, offset)) > 0)
+        {
+            pthread_mutex_unlock(&info->mutex);
+            stats_add(STATS_BYTES_MEMORY, count);
+            return count;
+        }
+        TRACE3(read_wait, path, offset, info->len);
+        pthread_cond_wait(&info->cond, &info->mutex);
+        TRACE2(read_woken, path, info->len);
+    }
+
+    if (!info->complete && !info->transcoding)
+    {
+        /* transcode failed or was refused */
+        pthread_mutex_unlock(&info->mutex);
+        return -EIO;
+    }
+
+    len = info->len;
+    pthread_mutex_unlock(&info->mutex);
+
+    if (len <= offset)
+        return 0;
+
+    count = min(len - offset, size);
+
+    /*
+     * Data below len doesn't change any more; the lock only keeps the
+     * writer from moving the segment table or dropping a failed file.
+     */
+    pthread_rwlock_rdlock(&info->buf_lock);
+    if (offset + count <= segbuf_alloc_len(&info->buf))
+        segbuf_read(&info->buf, offset, buf, count);
+    else
+        count = -EIO;
+    pthread_rwlock_unlock(&info->buf_lock);
+
+    if (count > 0)
+        stats_add(STATS_BYTES_MEMORY, count);
+    return count;
+}
+
+/*
+ *  Like gstfs_read, but files read from an fd are handed back as the fd,
+ *  so that fuse can splice them to the kernel without a copy through
+ *  userspace.  That includes complete files kept in a spill file or memfd.
+ *  Data in plain memory is still copied: fuse frees the memory buffers it
+ *  is given.
+ */
+int gstfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+    off_t offset, struct fuse_file_info *fi)
+{
+    struct gstfs_handle *fh = (struct gstfs_handle *) (uintptr_t) fi->fh;
+    struct gstfs_file_info *info = fh->info;
+    struct fuse_bufvec *bv;
+    ssize_t count;
+    char *mem;
+    int fd;
+
+    TRACE3(read, path, offset, size);
+    bv = malloc(sizeof(struct fuse_bufvec));
+    if (!bv)
+        return -ENOMEM;
+
+    if (fh->fd != -1)
+    {
+        *bv = FUSE_BUFVEC_INIT(size);
+        bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bv->buf[0].fd = fh->fd;
+        bv->buf[0].pos = offset;
+        *bufp = bv;
+
+        if (offset < fh->fd_size)
+            stats_add(fh->info ? STATS_BYTES_DISK : STATS_BYTES_PASSTHROUGH,
+                min(fh->fd_size - offset, size));
+        TRACE2(read_done, path, offset < fh->fd_size ?
+            min(fh->fd_size - offset, size) : 0);
+        return 0;
+    }
+
+    /* the backing file is longer than the data, so stop at len */
+    if (info && g_atomic_int_get(&info->complete) &&
+        (fd = segbuf_fd(&info->buf)) != -1)
+    {
+        count = offset < info->len ? min(info->len - offset, size) : 0;
+        *bv = FUSE_BUFVEC_INIT(count);
+        bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bv->buf[0].fd = fd;
+        bv->buf[0].pos = offset;
+        *bufp = bv;
+
+        stats_add(STATS_BYTES_MEMORY, count);
+        TRACE2(read_done, path, count);
+        return 0;
+    }
+
+    mem = malloc(size);
+    count = mem ? gstfs_read(path, mem, size, offset, fi) : -ENOMEM;
+    TRACE2(read_done, path, count);
+    if (count < 0)
+    {
+        free(mem);
+        free(bv);
+        return count;
+    }
+
+    *bv = FUSE_BUFVEC_INIT(count);
+    bv->buf[0].mem = mem;
+    *bufp = bv;
+    return 0;
+}
+
+/*
+ * Tries to open given file (expected to be from source mountpoint)
+ * and sets *size to its size.
+ *
+ * Returns the fd, or -errno.
+ */
+int gstfs_open_srcfile(const char *path, off_t *size)
+{
+    struct stat stbuf;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+
+    *size = fstat(fd, &stbuf) ? 0 : stbuf.st_size;
+    return fd;
+}
+
+/*
+ *  Drop a handle created by gstfs_open, unpinning its cache entry.
+ */
+static void put_handle(struct gstfs_handle *fh)
+{
+    if (fh->fd != -1)
+        close(fh->fd);
+
+    if (fh->info)
+        cache_unpin(fh->info);
+    g_free(fh->text);
+    free(fh);
+}
+
+/*
+ *  Queue background transcodes of the mount_info.prefetch files that
+ *  follow the file at data, a mount path to be freed with g_free, in the
+ *  listing of its directory, as long as the cache has room for them.
+ *  Runs as a background job, so that the opener doesn't wait for the
+ *  directory to be read.
+ */
+static void prefetch_siblings(void *data)
+{
+    char *path = (char *) data;
+    struct dir_listing *dl;
+    char *dir, *name;
+    size_t i, planned = 0;
+    int queued = 0;
+
+    dir = g_path_get_dirname(path);
+    name = g_path_get_basename(path);
+    if (get_listing(dir, &dl))
+        dl = NULL;
+
+    i = 0;
+    while (dl && i < dl->nentries && strcmp(dl->entries[i].name, name))
+        i++;
+
+    for (i++; dl && i < dl->nentries && queued < mount_info.prefetch; i++)
+    {
+        struct gstfs_file_info *sibling;
+        char *sibling_path;
+        size_t size;
+
+        sibling_path = g_strdup_printf("%s/%s", strcmp(dir, "/") ? dir : "",
+            dl->entries[i].name);
+        sibling = gstfs_lookup(sibling_path, CACHE_PIN);
+        g_free(sibling_path);
+
+        /* only sources that are transcoded */
+        if (!sibling)
+            continue;
+        queued++;
+
+        /* guess the output size from the source if nothing better is known */
+        size = sibling->size_hint;
+        if (!size)
+            size = dl->entries[i].stbuf.st_size;
+
+        if (!sibling->complete && !sibling->transcoding)
+        {
+            if (!cache_has_room(planned + size))
+            {
+                cache_unpin(sibling);
+                break;
+            }
+            planned += size;
+        }
+
+        pthread_mutex_lock(&sibling->mutex);
+        start_transcode(sibling, SCHED_BACKGROUND);
+        pthread_mutex_unlock(&sibling->mutex);
+        cache_unpin(sibling);
+    }
+
+    if (dl)
+        pathcache_put_dir(dl);
+    g_free(dir);
+    g_free(name);
+    g_free(path);
+}
+
+int gstfs_open(const char *path, struct fuse_file_info *fi)
+{
+    struct gstfs_file_info *info;
+    struct gstfs_handle *fh;
+    int ret = 0;
+
+    /* snapshot the stats, so that reads see consistent contents */
+    if (!strcmp(path, STATS_FILE))
+    {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+
+        fh = calloc(1, sizeof(struct gstfs_handle));
+        fh->fd = -1;
+        fh->text = get_stats();
+        fh->text_len = strlen(fh->text);
+        fi->fh = (uintptr_t) fh;
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    TRACE2(open, path, fi->flags);
+    info = gstfs_lookup(path, CACHE_PIN | CACHE_TOUCH);
+    fh = calloc(1, sizeof(struct gstfs_handle));
+    fh->fd = -1;
+    fh->info = info;
+    fi->fh = (uintptr_t) fh;
+
+    if (!info)
+    {
+        struct source_info si;
+
+        resolve_path(path, &si);
+        fh->fd = si.error ? -si.error :
+            gstfs_open_srcfile(si.path, &fh->fd_size);
+        g_free(si.path);
+        if (fh->fd < 0)
+        {
+            ret = fh->fd;
+            fh->fd = -1;
+            put_handle(fh);
+        }
+        else
+            stats_add(STATS_OPEN_PASSTHROUGH, 1);
+        TRACE2(open_done, path, ret);
+        return ret;
+    }
+
+    lock_info(info);
+    check_disk_cache(info);
+
+    /* fall back to transcoding if the cache_dir entry went away */
+    if (info->on_disk)
+    {
+        fh->fd = gstfs_open_srcfile(info->cache_filename, &fh->fd_size);
+        if (fh->fd < 0)
+        {
+            fh->fd = -1;
+            info->on_disk = 0;
+            info->complete = 0;
+        }
+    }
+
+    /* don't pay for another pipeline that is bound to fail */
+    if (!info->complete && !info->transcoding && failed_recently(info))
+    {
+        pthread_mutex_unlock(&info->mutex);
+        put_handle(fh);
+        stats_add(STATS_OPEN_FAILED, 1);
+        TRACE2(open_done, path, -EIO);
+        return -EIO;
+    }
+
+    if (fh->fd != -1)
+        stats_add(STATS_OPEN_DISK, 1);
+    else if (info->complete)
+        stats_add(STATS_OPEN_MEMORY, 1);
+    else
+        stats_add(info->transcoding ? STATS_OPEN_JOINED : STATS_OPEN_MISS, 1);
+
+    start_transcode(info, SCHED_INTERACTIVE);
+
+    /*
+     * Size is unknown until the transcode finishes, so let reads through
+     * to us instead of having the kernel clip them at a stale st_size.
+     * The same goes for a file completed since the kernel last asked for
+     * its size.  Otherwise the data won't change any more, so the page
+     * cache may keep it across opens, once the first open of this entry
+     * had the kernel drop what it kept of an older version of the file.
+     */
+    if (!info->complete || info->reported_size != info->len)
+        fi->direct_io = 1;
+    else if (info->cache_flushed)
+        fi->keep_cache = 1;
+    else
+        info->cache_flushed = 1;
+
+    pthread_mutex_unlock(&info->mutex);
+    TRACE2(open_done, path, ret);
+
+    if (mount_info.prefetch)
+        sched_submit_task(prefetch_siblings, g_strdup(path), SCHED_BACKGROUND);
+    return ret;
+}
+
+int gstfs_release(const char *path, struct fuse_file_info *fi)
+{
+    put_handle((struct gstfs_handle *) (uintptr_t) fi->fh);
+    return 0;
+}
+
+/*
+ *  Return true if the directory whose files names holds has a file of a
+ *  source type ahead of that of source, shown under the same name.
+ */
+static int shadowed(const char *source, GHashTable *names)
+{
+    int stem = strrchr(source, '.') - source;
+    int i, t = source_type(source), ret = 0;
+    char *s;
+
+    for (i = 0; i < t && !ret; i++)
+    {
+        s = g_strdup_printf("%.*s.%s", stem, source,
+            mount_info.src_types[i].ext);
+        ret = g_hash_table_lookup(names, s) != NULL;
+        g_free(s);
+    }
+    return ret;
+}
+
+/*
+ *  Remove the entries of a listing being read whose name in the mount is
+ *  already taken, by a source of that name or one of an earlier source
+ *  type, so that every name is listed once and for the file it resolves
+ *  to.  sources holds the source name of each entry, NULL if it couldn't
+ *  be stat'ed.
+ */
+static void drop_shadowed(GArray *entries, GPtrArray *sources)
+{
+    GHashTable *names = g_hash_table_new(g_str_hash, g_str_equal);
+    GPtrArray *dropped = g_ptr_array_new();
+    struct dir_entry *e;
+    char *source;
+    guint i, n;
+
+    for (i = 0; i < sources->len; i++)
+    {
+        if ((source = g_ptr_array_index(sources, i)))
+            g_hash_table_insert(names, source, source);
+    }
+
+    for (i = 0, n = 0; i < entries->len; i++)
+    {
+        e = &g_array_index(entries, struct dir_entry, i);
+        source = g_ptr_array_index(sources, i);
+        if (source && strcmp(e->name, source) &&
+            (g_hash_table_lookup(names, e->name) || shadowed(source, names)))
+        {
+            g_free(e->name);
+            g_ptr_array_add(dropped, source);
+            continue;
+        }
+        g_array_index(entries, struct dir_entry, n) = *e;
+        g_ptr_array_index(sources, n) = source;
+        n++;
+    }
+    g_array_set_size(entries, n);
+    g_ptr_array_set_size(sources, n);
+
+    /* names refers to the dropped sources too, so free them after it */
+    g_hash_table_destroy(names);
+    for (i = 0; i < dropped->len; i++)
+        g_free(g_ptr_array_index(dropped, i));
+    g_ptr_array_free(dropped, TRUE);
+}
+
+/*
+ *  Seed the path cache with what the entries of a listing of path, just
+ *  read from source_path, resolve to.  An entry only resolves to the
+ *  source file it was listed for if no source file has its mount name,
+ *  and none of an earlier source type is shown under it.
+ */
+static void seed_path_cache(const char *path, struct gstfs_profile *p,
+    const char *source_path, struct dir_listing *dl, char **sources,
+    unsigned gen)
+{
+    GHashTable *names = g_hash_table_new(g_str_hash, g_str_equal);
+    struct source_info si;
+    char *mount_path;
+    size_t i;
+
+    for (i = 0; i < dl->nentries; i++)
+    {
+        if (sources[i])
+            g_hash_table_insert(names, sources[i], sources[i]);
+    }
+
+    for (i = 0; i < dl->nentries; i++)
+    {
+        struct dir_entry *e = &dl->entries[i];
+
+        if (!sources[i] || !strcmp(e->name, ".") || !strcmp(e->name, ".."))
+            continue;
+        if (strcmp(e->name, sources[i]) &&
+            (g_hash_table_lookup(names, e->name) ||
+             shadowed(sources[i], names)))
+            continue;
+
+        si.path = g_strdup_printf("%s/%s", source_path, sources[i]);
+        si.error = 0;
+        si.stbuf = e->stbuf;
+        si.transcoded = is_target_type(e->name, p) &&
+            !is_target_type(si.path, p);
+        si.generation = gen;
+
+        mount_path = g_strdup_printf("%s/%s", strcmp(path, "/") ? path : "",
+            e->name);
+        pathcache_store(mount_path, &si);
+        g_free(mount_path);
+        g_free(si.path);
+    }
+    g_hash_table_destroy(names);
+}
+
+/*
+ *  Return a listing of the root of a mount with several profiles: a
+ *  directory for each, with the attributes of the source directory.
+ */
+static struct dir_listing *get_profile_listing(void)
+{
+    struct dir_listing *dl;
+    struct stat stbuf;
+    int i;
+
+    if (stat(mount_info.src_mnt, &stbuf))
+        memset(&stbuf, 0, sizeof(stbuf));
+
+    dl = g_new(struct dir_listing, 1);
+    dl->refs = 1;
+    dl->nentries = mount_info.nprofiles + 2;
+    dl->entries = g_new(struct dir_entry, dl->nentries);
+    dl->entries[0].name = g_strdup(".");
+    dl->entries[1].name = g_strdup("..");
+    for (i = 0; i < mount_info.nprofiles; i++)
+        dl->entries[i + 2].name = g_strdup(mount_info.profiles[i].name);
+    for (i = 0; i < dl->nentries; i++)
+        dl->entries[i].stbuf = stbuf;
+    return dl;
+}
+
+/*
+ *  Return a listing of the source directory of path, with the names shown
+ *  in the mount and the attributes of the source files, from the path
+ *  cache if possible.
+ *
+ *  Returns 0 or -errno.
+ */
+static int get_listing(const char *path, struct dir_listing **listing)
+{
+    struct gstfs_profile *p;
+    struct dir_listing *dl;
+    struct dirent *dirent;
+    GArray *entries;
+    GPtrArray *sources;
+    char *source_path, *s;
+    const char *rel;
+    unsigned gen;
+    DIR *dir;
+    int ret = 0;
+    guint i;
+
+    p = split_profile(path, &rel);
+    if (!rel)
+        return -ENOENT;
+    if (!p)
+    {
+        *listing = get_profile_listing();
+        return 0;
+    }
+
+    source_path = get_source_path(path);
+    if ((*listing = pathcache_lookup_dir(path, source_path, &gen)))
+    {
+        g_free(source_path);
+        return 0;
+    }
+
+    dir = opendir(source_path);
+    if (!dir)
+    {
+        ret = -errno;
+        g_free(source_path);
+        return ret;
+    }
+
+    entries = g_array_new(FALSE, FALSE, sizeof(struct dir_entry));
+    sources = g_ptr_array_new();
+    while ((dirent = readdir(dir)))
+    {
+        struct dir_entry e;
+
+        /* entries that can't be stat'ed, e.g. dangling links, are shown */
+        s = g_strdup(dirent->d_name);
+        if (fstatat(dirfd(dir), dirent->d_name, &e.stbuf, 0))
+        {
+            memset(&e.stbuf, 0, sizeof(e.stbuf));
+            e.stbuf.st_ino = dirent->d_ino;
+            g_free(s);
+            s = NULL;
+        }
+
+        e.name = shown_name(dirent->d_name, p);
+        g_array_append_val(entries, e);
+        g_ptr_array_add(sources, s);
+    }
+    closedir(dir);
+    drop_shadowed(entries, sources);
+
+    dl = g_new(struct dir_listing, 1);
+    dl->refs = 1;
+    dl->nentries = entries->len;
+    dl->entries = (struct dir_entry *) g_array_free(entries, FALSE);
+
+    seed_path_cache(path, p, source_path, dl, (char **) sources->pdata, gen);
+    pathcache_store_dir(path, dl, gen);
+
+    for (i = 0; i < sources->len; i++)
+        g_free(g_ptr_array_index(sources, i));
+    g_ptr_array_free(sources, TRUE);
+    g_free(source_path);
+
+    *listing = dl;
+    return 0;
+}
+
+/*
+ *  Take a snapshot of the directory's listing, so that reading it in
+ *  several parts sees consistent offsets.
+ */
+int gstfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct dir_listing *dl = NULL;
+    int ret = 0;
+
+    if (strcmp(path, STATS_DIR))
+        ret = get_listing(path, &dl);
+
+    fi->fh = (uintptr_t) dl;
+    return ret;
+}
+
+/*
+ *  Copy entries from the listing of the source, starting at offset.  The
+ *  root starts with STATS_DIR, so that a full buffer can't leave it out.
+ */
+int gstfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info *fi)
+{
+    struct dir_listing *dl = (struct dir_listing *) (uintptr_t) fi->fh;
+    struct stat stbuf;
+    size_t i, first = 0;
+
+    if (!dl)
+    {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        filler(buf, STATS_FILE + strlen(STATS_DIR) + 1, NULL, 0);
+        return 0;
+    }
+
+    if (!strcmp(path, "/"))
+    {
+        first = 1;
+        if (offset == 0)
+        {
+            virtual_getattr(STATS_DIR, &stbuf);
+            if (filler(buf, STATS_DIR + 1, &stbuf, 1))
+                return 0;
+            offset = 1;
+        }
+    }
+
+    /* the next offset to read from is the index of the entry plus one */
+    for (i = offset - first; i < dl->nentries; i++)
+    {
+        if (filler(buf, dl->entries[i].name, &dl->entries[i].stbuf,
+                i + first + 1))
+            return 0;
+    }
+    return 0;
+}
+
+int gstfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct dir_listing *dl = (struct dir_listing *) (uintptr_t) fi->fh;
+
+    if (dl)
+        pathcache_put_dir(dl);
+    return 0;
+}
+
+int gstfs_access(const char *path, int mode)
+{
+    struct source_info si;
+    int ret;
+
+    if (!strcmp(path, STATS_DIR) || !strcmp(path, STATS_FILE))
+        return (mode & W_OK) ? -EACCES : 0;
+
+    resolve_path(path, &si);
+    ret = si.error ? -si.error : access(si.path, mode);
+    g_free(si.path);
+    return ret;
+}
+
+void *gstfs_init(struct fuse_conn_info *conn)
+{
+    /* let read_buf's fds be spliced into the fuse device */
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE |
+        FUSE_CAP_SPLICE_MOVE);
+
+    /* threads started before fuse_main don't survive daemonizing */
+    cache_start();
+    pathcache_start();
+    sched_start(mount_info.max_transcodes, transcode_file);
+    if (mount_info.pressure)
+        pressure_start();
+    return NULL;
+}
+
+static struct fuse_operations gstfs_opers = {
+    .init = gstfs_init,
+    .access = gstfs_access,
+    .opendir = gstfs_opendir,
+    .readdir = gstfs_readdir,
+    .releasedir = gstfs_releasedir,
+    .statfs = gstfs_statfs,
+    .getattr = gstfs_getattr,
+    .open = gstfs_open,
+    .read = gstfs_read,
+    .read_buf = gstfs_read_buf,
+    .release = gstfs_release
+};
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    if (gstfs_parse_opts(&args))
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (gstfs_check_paths())
+        return -1;
+
+    if (segbuf_init(mount_info.spill_dir, mount_info.memfd))
+    {
+        fprintf(stderr, "gstfs: memfd is not supported\n");
+        return -1;
+    }
+
+    if (mount_info.size_index)
+    {
+        int err;
+
+        if ((err = sizeindex_open(mount_info.size_index)))
+        {
+            fprintf(stderr, "gstfs: size index: %s\n", strerror(-err));
+            return -1;
+        }
+    }
+
+    if (cache_init(mount_info.cache_policy))
+    {
+        fprintf(stderr, "gstfs: unknown cache policy %s\n",
+            mount_info.cache_policy);
+        return -1;
+    }
+
+    pathcache_init(mount_info.path_ttl);
+
+    if (mount_info.pressure && pressure_init(mount_info.pressure))
+        return -1;
+
+    gst_init(&argc, &argv);
+    gstfs_transcode_set_pool_size(mount_info.npipelines);
+    /*
+     * The kernel can't be told when paths change, so only cache them for a
+     * while; sizes of complete files don't change and are kept in the page
+     * cache through keep_cache.
+     */
+    if (!has_fuse_opt(&args, "attr_timeout"))
+        fuse_opt_add_arg(&args, "-oattr_timeout=" DEFAULT_KERNEL_TTL);
+    if (!has_fuse_opt(&args, "entry_timeout"))
+        fuse_opt_add_arg(&args, "-oentry_timeout=" DEFAULT_KERNEL_TTL);
 
-    gst_init(&argc, &argv);
     return fuse_main(args.argc, args.argv, &gstfs_opers, NULL);
 }
@@ -0,0 +1,164 @@
+#ifndef _GSTFS_H
+#define _GSTFS_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <glib.h>
+#include "segbuf.h"
+
+/* a subtree of the mount, showing the sources transcoded one way */
+struct gstfs_profile
+{
+    char *name;                  /* top directory, NULL for the whole mount */
+    char *dst_ext;               /* extension of its target files */
+    char *encoder;               /* encoding part of the pipeline, or NULL */
+    char **pipelines;            /* whole pipelines, by source type */
+};
+
+/* files of the source mount that are transcoded, by extension */
+struct gstfs_source_type
+{
+    char *ext;
+    char *pipeline;              /* pipeline.ext, in place of pipeline */
+    char *decoder;               /* decoder.ext, in place of decoder */
+};
+
+/* per-mount options and data structures */
+struct gstfs_mount_info
+{
+    int max_cache_entries;       /* max # of entries in the cache */
+    int max_cache_mb;            /* byte budget of the cache, in MiB */
+    size_t max_cache_bytes;      /* max_cache_mb in bytes, 0 if unlimited */
+    char *src_mnt;               /* directory we are mirroring */
+    char *src_ext;               /* extension of files we transcode */
+    char *dst_ext;               /* extension of target files */
+    char *pipeline;              /* gstreamer pipeline */
+    char *cache_dir;             /* persistent cache of transcoded files */
+    int npipelines;              /* parsed pipelines kept for reuse */
+    char *size_index;            /* persistent index of transcoded sizes */
+    int bitrate;                 /* kbit/s of CBR output, to estimate sizes */
+    int max_transcodes;          /* # of transcodes running at once */
+    int prefetch;                /* # of following files to transcode ahead */
+    char *cache_policy;          /* name of the replacement policy */
+    int path_ttl;                /* seconds to cache resolved paths */
+    char *spill_dir;             /* directory of files backing the cache */
+    int memfd;                   /* back the cache by memfds */
+    int shared_cache;            /* cache_dir is filled by other hosts too */
+    int pressure;                /* % of memory stalls to shrink at, or 0 */
+    int segments;                /* # of parts long files are split into */
+    int segment_secs;            /* minimum length of a part */
+    char *decoder;               /* decoding part of profile pipelines */
+    struct gstfs_profile *profiles;  /* at least one */
+    int nprofiles;
+    struct gstfs_source_type *src_types;  /* src_ext first, if given */
+    int nsrc_types;
+};
+
+/* transcode job priorities, most urgent first */
+enum
+{
+    SCHED_INTERACTIVE,           /* somebody opened the file */
+    SCHED_BACKGROUND,            /* prefetch and other speculative work */
+    SCHED_NPRIO
+};
+
+struct seek_fill;
+
+/* This stuff is stored into file_cache by filename */
+struct gstfs_file_info
+{
+    char *filename;           /* hash key */
+    char *src_filename;       /* filename in other mount */
+    char *cache_key;          /* key into cache_dir and size_index */
+    char *cache_filename;     /* entry in cache_dir, NULL if disabled */
+    struct gstfs_profile *profile; /* how the file is transcoded */
+    char *pipeline;           /* pipeline of the profile for its source */
+    time_t src_mtime;         /* source attributes the entry was made from */
+    off_t src_size;
+    ino_t src_ino;
+    int on_disk;              /* contents are served from cache_filename */
+    int disk_checked;         /* cache_filename was looked for */
+    int lease;                /* holds the shared cache_dir lease on it */
+    pthread_mutex_t mutex;    /* protects this file info */
+    pthread_cond_t cond;      /* signalled when buf grows or transcode ends */
+    int transcoding;          /* background transcode is running */
+    int complete;             /* buf holds the whole converted file */
+    size_t len;               /* size of file */
+    size_t size_hint;         /* expected size until complete, 0 if unknown */
+    off_t reported_size;      /* size getattr last reported to the kernel */
+    int cache_flushed;        /* opened once without keep_cache */
+    int estimated;            /* size estimator has been run */
+    size_t alloc_len;         /* allocated size of buf */
+    gint64 transcode_start;   /* monotonic time the last transcode began */
+    gint64 transcode_usecs;   /* time it took to transcode, 0 if unknown */
+    int error;                /* -errno of the last transcode, 0 if it worked */
+    int failures;             /* # of times in a row it failed */
+    gint64 retry_after;       /* monotonic time to transcode again after */
+    time_t failed_mtime;      /* source mtime and size when it failed */
+    off_t failed_size;
+    struct segbuf buf;        /* converted file, possibly still growing */
+    struct seek_fill *seek;   /* output ahead of buf after a seek, or NULL */
+    int seek_mismatch;        /* a seek's output didn't match the file's */
+    pthread_rwlock_t buf_lock; /* write-held while buf's segments change */
+
+    /* the rest is protected by the mutex of the cache shard */
+    int shard;                /* cache shard holding this file */
+    GList *list_node;         /* position in one of the policy's lists */
+    int list;                 /* which of the shard's lists it is in */
+    gint64 last_access;       /* monotonic time of last open */
+    guint hits;               /* # of opens while cached */
+    double priority;          /* gdsf's eviction priority */
+    int refs;                 /* open handles */
+
+    /* protected by the scheduler's mutex */
+    GList *sched_node;        /* position in a job queue, NULL if not queued */
+    int sched_prio;           /* queue sched_node is in */
+};
+
+extern struct gstfs_mount_info mount_info;
+
+/* gstfs.c */
+struct gstfs_file_info *get_file_info(const char *filename);
+void put_file_info(struct gstfs_file_info *fi);
+struct gstfs_profile *split_profile(const char *path, const char **rel);
+char *profile_path(const struct gstfs_profile *p, const char *rel);
+
+/* options.c */
+struct fuse_args;
+
+int gstfs_parse_opts(struct fuse_args *args);
+int gstfs_check_paths(void);
+int source_type(const char *filename);
+char *shown_name(const char *name, const struct gstfs_profile *p);
+
+/* cache.c */
+#define CACHE_PIN   1         /* keep the entry until cache_unpin */
+#define CACHE_TOUCH 2         /* count the lookup as a use of the entry */
+#define CACHE_PEEK  4         /* return NULL instead of creating an entry */
+
+int cache_init(const char *policy_name);
+void cache_start(void);
+struct gstfs_file_info *cache_lookup(const char *path, int flags);
+void cache_unpin(struct gstfs_file_info *fi);
+int cache_drop(struct gstfs_file_info *fi);
+int cache_has_room(size_t bytes);
+void cache_account(ssize_t delta);
+void cache_kick(void);
+void cache_update(struct gstfs_file_info *fi);
+void cache_usage(guint *entries, size_t *bytes);
+void cache_set_pressure_limit(size_t bytes);
+
+/* sched.c */
+void sched_start(int nworkers, void (*run)(struct gstfs_file_info *));
+void sched_submit(struct gstfs_file_info *fi, int prio);
+void sched_submit_task(void (*run)(void *), void *data, int prio);
+int sched_take_slots(int n);
+void sched_put_slots(int n);
+void sched_promote(struct gstfs_file_info *fi, int prio);
+int sched_steal(struct gstfs_file_info *fi);
+
+/* pressure.c */
+int pressure_init(int percent);
+void pressure_start(void);
+
+#endif /* _GSTFS_H */
@@ -0,0 +1,411 @@
+/*
+ * gstfs - mount options, shared by gstfs and gstfs-warm
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fuse.h>
+#include <glib.h>
+#include "gstfs.h"
+
+#define max(a,b) ((a)>(b)?(a):(b))
+
+/* decoder of profile pipelines unless given */
+#define DEFAULT_DECODER "filesrc name=\"_source\" ! decodebin"
+
+#define GSTFS_OPT_KEY(templ, elem, key) \
+    { templ, offsetof(struct gstfs_mount_info, elem), key }
+
+/* outputs made of self-contained frames, which segments may cut and join */
+static const char *segment_exts[] = { "mp3", "mp2", "aac", "ac3", "pcm", "raw",
+    NULL };
+
+/* options handled by gstfs_opt_proc */
+enum
+{
+    KEY_PROFILE
+};
+
+struct gstfs_mount_info mount_info;
+
+static struct fuse_opt gstfs_opts[] = {
+    GSTFS_OPT_KEY("src=%s", src_mnt, 0),
+    GSTFS_OPT_KEY("src_ext=%s", src_ext, 0),
+    GSTFS_OPT_KEY("dst_ext=%s", dst_ext, 0),
+    GSTFS_OPT_KEY("ncache=%d", max_cache_entries, 0),
+    GSTFS_OPT_KEY("cache_mb=%d", max_cache_mb, 0),
+    GSTFS_OPT_KEY("cache_dir=%s", cache_dir, 0),
+    GSTFS_OPT_KEY("npipelines=%d", npipelines, 0),
+    GSTFS_OPT_KEY("size_index=%s", size_index, 0),
+    GSTFS_OPT_KEY("bitrate=%d", bitrate, 0),
+    GSTFS_OPT_KEY("max_transcodes=%d", max_transcodes, 0),
+    GSTFS_OPT_KEY("prefetch=%d", prefetch, 0),
+    GSTFS_OPT_KEY("cache_policy=%s", cache_policy, 0),
+    GSTFS_OPT_KEY("path_ttl=%d", path_ttl, 0),
+    GSTFS_OPT_KEY("spill_dir=%s", spill_dir, 0),
+    GSTFS_OPT_KEY("memfd", memfd, 1),
+    GSTFS_OPT_KEY("shared_cache", shared_cache, 1),
+    GSTFS_OPT_KEY("pressure=%d", pressure, 0),
+    GSTFS_OPT_KEY("segments=%d", segments, 0),
+    GSTFS_OPT_KEY("segment_secs=%d", segment_secs, 0),
+    GSTFS_OPT_KEY("pipeline=%s", pipeline, 0),
+    GSTFS_OPT_KEY("decoder=%s", decoder, 0),
+    FUSE_OPT_KEY("profile=", KEY_PROFILE),
+    FUSE_OPT_END
+};
+
+/*
+ *  Add a profile given as name:ext:encoder.  Returns 0 or -1 if the
+ *  spec is malformed.  Names starting with a dot are taken by gstfs'
+ *  own files.
+ */
+static int add_profile(const char *spec)
+{
+    struct gstfs_profile *p;
+    char **fields;
+    int i, ret = -1;
+
+    fields = g_strsplit(spec, ":", 3);
+    if (g_strv_length(fields) != 3 || !*fields[0] || !*fields[1] ||
+        !*fields[2] || strchr(fields[0], '/') || fields[0][0] == '.')
+        goto out;
+
+    for (i = 0; i < mount_info.nprofiles; i++)
+    {
+        if (!strcmp(mount_info.profiles[i].name, fields[0]))
+            goto out;
+    }
+
+    mount_info.profiles = g_renew(struct gstfs_profile, mount_info.profiles,
+        mount_info.nprofiles + 1);
+    p = &mount_info.profiles[mount_info.nprofiles++];
+    p->name = g_strdup(fields[0]);
+    p->dst_ext = g_strdup(fields[1]);
+    p->encoder = g_strdup(fields[2]);
+    p->pipelines = NULL;
+    ret = 0;
+out:
+    g_strfreev(fields);
+    return ret;
+}
+
+/*
+ *  Return the source type of extension ext, adding it if it is new.
+ */
+static struct gstfs_source_type *get_source_type(const char *ext)
+{
+    struct gstfs_source_type *t;
+    int i;
+
+    for (i = 0; i < mount_info.nsrc_types; i++)
+    {
+        if (!strcmp(mount_info.src_types[i].ext, ext))
+            return &mount_info.src_types[i];
+    }
+
+    mount_info.src_types = g_renew(struct gstfs_source_type,
+        mount_info.src_types, mount_info.nsrc_types + 1);
+    t = &mount_info.src_types[mount_info.nsrc_types++];
+    t->ext = g_strdup(ext);
+    t->pipeline = NULL;
+    t->decoder = NULL;
+    return t;
+}
+
+/*
+ *  Take an option of the form pipeline.ext=... or decoder.ext=...
+ *  Returns 0, 1 if arg is no such option or -1 if it is malformed.
+ */
+static int add_source_opt(const char *arg)
+{
+    struct gstfs_source_type *t;
+    const char *ext, *value;
+    char *name;
+    int pipeline;
+
+    if (g_str_has_prefix(arg, "pipeline."))
+        pipeline = 1;
+    else if (g_str_has_prefix(arg, "decoder."))
+        pipeline = 0;
+    else
+        return 1;
+
+    ext = strchr(arg, '.') + 1;
+    value = strchr(ext, '=');
+    if (!value || value == ext || !value[1] || memchr(ext, '.', value - ext))
+        return -1;
+
+    name = g_strndup(ext, value - ext);
+    t = get_source_type(name);
+    g_free(name);
+    if (pipeline)
+        t->pipeline = g_strdup(value + 1);
+    else
+        t->decoder = g_strdup(value + 1);
+    return 0;
+}
+
+static int gstfs_opt_proc(void *data, const char *arg, int key,
+    struct fuse_args *outargs)
+{
+    int ret;
+
+    if (key == FUSE_OPT_KEY_OPT)
+    {
+        if ((ret = add_source_opt(arg)) < 0)
+            fprintf(stderr, "gstfs: bad option %s\n", arg);
+        return ret;
+    }
+
+    if (key != KEY_PROFILE)
+        return 1;
+
+    if (add_profile(arg + strlen("profile=")))
+    {
+        fprintf(stderr, "gstfs: bad profile %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Return the index of the source type filename is of, or -1 if it
+ *  isn't transcoded.
+ */
+int source_type(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+    int i;
+
+    if (!ext || strchr(ext, '/'))
+        return -1;
+
+    for (i = 0; i < mount_info.nsrc_types; i++)
+    {
+        if (!strcmp(ext + 1, mount_info.src_types[i].ext))
+            return i;
+    }
+    return -1;
+}
+
+/*
+ *  Return the name the source file name is shown as in profile p, to be
+ *  freed with g_free.
+ */
+char *shown_name(const char *name, const struct gstfs_profile *p)
+{
+    const char *ext = strrchr(name, '.');
+    int t = source_type(name);
+
+    if (t < 0 || !strcmp(mount_info.src_types[t].ext, p->dst_ext))
+        return g_strdup(name);
+    return g_strdup_printf("%.*s.%s", (int) (ext - name), name, p->dst_ext);
+}
+
+/*
+ *  Fill in the pipelines of profile p for every source type.  Returns 0,
+ *  or -1 after telling which type has none.
+ */
+static int build_pipelines(struct gstfs_profile *p)
+{
+    struct gstfs_source_type *t;
+    int i;
+
+    p->pipelines = g_new0(char *, mount_info.nsrc_types);
+    for (i = 0; i < mount_info.nsrc_types; i++)
+    {
+        t = &mount_info.src_types[i];
+        if (p->encoder)
+            p->pipelines[i] = g_strdup_printf("%s ! %s ! "
+                "appsink name=\"_dest\" sync=false",
+                t->decoder ? t->decoder : mount_info.decoder, p->encoder);
+        else
+            p->pipelines[i] = t->pipeline ? t->pipeline : mount_info.pipeline;
+
+        /* files that already are of the target type are passed through */
+        if (!p->pipelines[i] && strcmp(t->ext, p->dst_ext))
+        {
+            fprintf(stderr, "gstfs: no pipeline for .%s files\n", t->ext);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static char *canonize(const char *cwd, const char *filename)
+{
+    if (filename[0] == '/')
+        return g_strdup(filename);
+    else
+        return g_strdup_printf("%s/%s", cwd, filename);
+}
+
+/*
+ *  Make *path absolute and check that it is a directory.  what names it
+ *  in error messages.  Returns 0, or -1 after telling why not.
+ */
+static int check_dir(const char *cwd, char **path, const char *what)
+{
+    struct stat stbuf;
+
+    *path = canonize(cwd, *path);
+    if (stat(*path, &stbuf) == -1)
+    {
+        fprintf(stderr, "gstfs: %s directory: %s\n", what, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISDIR(stbuf.st_mode))
+    {
+        fprintf(stderr, "gstfs: %s path is not directory\n", what);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Return true if files of profile p may be transcoded in segments.
+ */
+static int can_segment(const struct gstfs_profile *p)
+{
+    int i;
+
+    for (i = 0; segment_exts[i]; i++)
+    {
+        if (!strcmp(p->dst_ext, segment_exts[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Parse the gstfs options out of args, leaving the others, e.g. those
+ *  for fuse, in it, and fill in the defaults and the profiles' pipelines.
+ *
+ *  Returns 0, or -1 if the options are malformed or incomplete.
+ */
+int gstfs_parse_opts(struct fuse_args *args)
+{
+    int i;
+
+    mount_info.npipelines = 4;
+    mount_info.path_ttl = 60;
+    mount_info.segment_secs = 60;
+    mount_info.pressure = -1;
+    if (fuse_opt_parse(args, &mount_info, gstfs_opts, gstfs_opt_proc) == -1)
+        return -1;
+
+    if (mount_info.pressure == -1)
+        mount_info.pressure = 0;
+    else if (mount_info.pressure < 1 || mount_info.pressure > 100)
+    {
+        fprintf(stderr, "gstfs: pressure must be from 1 to 100\n");
+        return -1;
+    }
+
+    if (!mount_info.src_mnt ||
+        (!mount_info.src_ext && !mount_info.nsrc_types) ||
+        (!mount_info.nprofiles && !mount_info.dst_ext))
+        return -1;
+
+    /* src_ext goes first when several sources could show as one file */
+    if (mount_info.src_ext)
+    {
+        struct gstfs_source_type t;
+
+        i = get_source_type(mount_info.src_ext) - mount_info.src_types;
+        t = mount_info.src_types[i];
+        memmove(&mount_info.src_types[1], &mount_info.src_types[0],
+            i * sizeof(t));
+        mount_info.src_types[0] = t;
+    }
+
+    /* without profiles, the whole mount is transcoded by pipeline */
+    if (!mount_info.nprofiles)
+    {
+        mount_info.profiles = g_new0(struct gstfs_profile, 1);
+        mount_info.profiles->dst_ext = mount_info.dst_ext;
+        mount_info.nprofiles = 1;
+    }
+
+    if (!mount_info.decoder)
+        mount_info.decoder = DEFAULT_DECODER;
+    for (i = 0; i < mount_info.nprofiles; i++)
+    {
+        if (build_pipelines(&mount_info.profiles[i]))
+            return -1;
+
+        /* containers have headers and framing that can't be concatenated */
+        if (mount_info.segments > 1 && !can_segment(&mount_info.profiles[i]))
+        {
+            fprintf(stderr, "gstfs: .%s files can't be transcoded in "
+                "segments\n", mount_info.profiles[i].dst_ext);
+            return -1;
+        }
+    }
+
+    if (mount_info.segment_secs <= 0)
+        mount_info.segment_secs = 1;
+
+    if (mount_info.max_transcodes <= 0)
+        mount_info.max_transcodes = max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+    /* with a byte budget, the number of entries is only limited on request */
+    if (mount_info.max_cache_entries == 0)
+        mount_info.max_cache_entries = mount_info.max_cache_mb ? G_MAXINT : 50;
+    mount_info.max_cache_bytes = (size_t) mount_info.max_cache_mb << 20;
+    return 0;
+}
+
+/*
+ *  Make the paths given in the options absolute, and check that the
+ *  directories exist.  The size index is kept next to the cached files
+ *  unless given, in a file of its own per host if they are shared, as
+ *  appends from several hosts to one file over NFS would interleave.
+ *
+ *  Returns 0, or -1 after telling why not.
+ */
+int gstfs_check_paths(void)
+{
+    char pwd[2048], host[256];
+
+    if (!getcwd(pwd, sizeof(pwd)))
+    {
+        perror("gstfs");
+        return -1;
+    }
+
+    if (check_dir(pwd, &mount_info.src_mnt, "source"))
+        return -1;
+    if (mount_info.cache_dir &&
+        check_dir(pwd, &mount_info.cache_dir, "cache"))
+        return -1;
+    if (mount_info.spill_dir &&
+        check_dir(pwd, &mount_info.spill_dir, "spill"))
+        return -1;
+
+    if (!mount_info.size_index && mount_info.cache_dir &&
+        mount_info.shared_cache)
+    {
+        if (gethostname(host, sizeof(host)))
+        {
+            perror("gstfs");
+            return -1;
+        }
+        host[sizeof(host) - 1] = 0;
+        mount_info.size_index = g_strdup_printf("%s/size_index.%s",
+            mount_info.cache_dir, host);
+    }
+    else if (!mount_info.size_index && mount_info.cache_dir)
+        mount_info.size_index = g_strdup_printf("%s/size_index",
+            mount_info.cache_dir);
+    if (mount_info.size_index)
+        mount_info.size_index = canonize(pwd, mount_info.size_index);
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * gstfs - cache of resolved source paths
+ *
+ * Maps paths in the mount to their source file and its stat results,
+ * including paths that don't exist, so getattr doesn't go to the source
+ * filesystem, and keeps directory listings.  The source directories of
+ * cached paths and listings are watched with inotify and entries are
+ * dropped as soon as anything changes there.  Watches are kept by the
+ * directory below the profiles, so that a source directory shown by
+ * several profiles is watched once and invalidated in all of them.
+ * Changes inotify can't see, e.g. made by other NFS clients, are picked up
+ * when entries expire after the ttl.
+ */
+
+#include <sys/inotify.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib.h>
+#include "pathcache.h"
+#include "gstfs.h"
+
+#define PATHCACHE_MAX_ENTRIES (1 << 17)
+#define PATHCACHE_MAX_LISTINGS 256
+
+#define WATCH_MASK (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | \
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct pathcache_entry
+{
+    struct source_info si;
+    gint64 expires;              /* monotonic time it is stale after */
+};
+
+struct pathcache_listing
+{
+    struct dir_listing *dl;
+    gint64 expires;
+};
+
+static pthread_rwlock_t pathcache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static GHashTable *entries;      /* mount path -> pathcache_entry */
+static GHashTable *listings;     /* mount directory -> pathcache_listing */
+static GHashTable *watch_dirs;   /* watch descriptor -> profile directory */
+static GHashTable *watched;      /* profile directory -> watch descriptor */
+static guint generation;         /* bumped by every change seen */
+static gint64 ttl_usecs;         /* 0 if the cache is disabled */
+static int inotify_fd = -1;
+
+static void free_entry(gpointer data)
+{
+    struct pathcache_entry *e = data;
+
+    g_free(e->si.path);
+    g_free(e);
+}
+
+static void free_listing(gpointer data)
+{
+    struct pathcache_listing *l = data;
+
+    pathcache_put_dir(l->dl);
+    g_free(l);
+}
+
+/*
+ *  Drop a reference to a listing, freeing it with the last one.
+ */
+void pathcache_put_dir(struct dir_listing *dl)
+{
+    size_t i;
+
+    if (!g_atomic_int_dec_and_test(&dl->refs))
+        return;
+
+    for (i = 0; i < dl->nentries; i++)
+        g_free(dl->entries[i].name);
+    g_free(dl->entries);
+    g_free(dl);
+}
+
+/*
+ *  Set up the cache, keeping entries for at most ttl seconds.  With a ttl
+ *  of 0 or without inotify, nothing is cached.
+ */
+void pathcache_init(int ttl)
+{
+    if (ttl <= 0)
+        return;
+
+    inotify_fd = inotify_init();
+    if (inotify_fd == -1)
+    {
+        perror("gstfs: inotify, not caching paths");
+        return;
+    }
+
+    entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+        free_entry);
+    listings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+        free_listing);
+    watch_dirs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+        g_free);
+    watched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    ttl_usecs = (gint64) ttl * G_USEC_PER_SEC;
+}
+
+/*
+ *  Return the path of name in the mount directory dir.
+ */
+static char *join(const char *dir, const char *name)
+{
+    return g_strdup_printf("%s/%s", strcmp(dir, "/") ? dir : "", name);
+}
+
+static gboolean in_tree(gpointer key, gpointer value, gpointer data)
+{
+    const char *path = key, *top = data;
+    size_t len = strlen(top);
+
+    if (!strcmp(top, "/"))
+        return TRUE;
+    return !strncmp(path, top, len) && (!path[len] || path[len] == '/');
+}
+
+/*
+ *  Drop top and everything below it.
+ *
+ *  Called with pathcache_lock held for writing.
+ */
+static void invalidate_tree(const char *top)
+{
+    g_hash_table_foreach_remove(entries, in_tree, (gpointer) top);
+    g_hash_table_foreach_remove(listings, in_tree, (gpointer) top);
+}
+
+/*
+ *  Drop the trees shown for profile directory top in every profile.
+ *
+ *  Called with pathcache_lock held for writing.
+ */
+static void invalidate_profiles(const char *top)
+{
+    char *path;
+    int i;
+
+    for (i = 0; i < mount_info.nprofiles; i++)
+    {
+        path = profile_path(&mount_info.profiles[i], top);
+        invalidate_tree(path);
+        g_free(path);
+    }
+}
+
+/*
+ *  Return the directory below its profile that mount path path is in, or
+ *  NULL if it isn't in a profile.
+ */
+static const char *profile_dir(const char *path)
+{
+    const char *rel;
+
+    return split_profile(path, &rel) ? rel : NULL;
+}
+
+/*
+ *  Stop watching a directory.  This will be followed by an IN_IGNORED
+ *  event, for a watch descriptor we no longer know.
+ *
+ *  Called with pathcache_lock held for writing.
+ */
+static void drop_watch(int wd)
+{
+    char *dir = g_hash_table_lookup(watch_dirs, GINT_TO_POINTER(wd));
+
+    if (!dir)
+        return;
+
+    inotify_rm_watch(inotify_fd, wd);
+    invalidate_profiles(dir);
+    g_hash_table_remove(watched, dir);
+    g_hash_table_remove(watch_dirs, GINT_TO_POINTER(wd));
+}
+
+static gboolean find_tree_watch(gpointer key, gpointer value, gpointer data)
+{
+    return in_tree(value, NULL, data);
+}
+
+/*
+ *  Drop what an event may have changed in mount directory dir, shown by
+ *  profile p.
+ *
+ *  Called with pathcache_lock held for writing.
+ */
+static void invalidate_event(const char *dir, const struct gstfs_profile *p,
+    struct inotify_event *ev)
+{
+    char *path, *name;
+
+    /* listings hold the attributes of entries too */
+    g_hash_table_remove(listings, dir);
+
+    /* the directory's own attributes changed */
+    if (!ev->len)
+    {
+        g_hash_table_remove(entries, dir);
+        return;
+    }
+
+    path = join(dir, ev->name);
+    g_hash_table_remove(entries, path);
+
+    /* a directory went away or came back under another name */
+    if (ev->mask & IN_ISDIR)
+        invalidate_tree(path);
+    g_free(path);
+
+    /* and the transcoded file that is shown for it */
+    name = shown_name(ev->name, p);
+    path = join(dir, name);
+    g_hash_table_remove(entries, path);
+    g_free(path);
+    g_free(name);
+}
+
+/*
+ *  Drop everything that may be affected by an event.
+ *
+ *  Called with pathcache_lock held for writing.
+ */
+static void handle_event(struct inotify_event *ev)
+{
+    char *dir, *path, *subdir;
+    int i;
+
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        g_hash_table_remove_all(entries);
+        g_hash_table_remove_all(listings);
+        return;
+    }
+
+    dir = g_hash_table_lookup(watch_dirs, GINT_TO_POINTER(ev->wd));
+    if (!dir)
+        return;
+
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        drop_watch(ev->wd);
+        return;
+    }
+
+    for (i = 0; i < mount_info.nprofiles; i++)
+    {
+        path = profile_path(&mount_info.profiles[i], dir);
+        invalidate_event(path, &mount_info.profiles[i], ev);
+        g_free(path);
+    }
+
+    /* watches of a directory that went away or was renamed, and below */
+    if (ev->len && (ev->mask & IN_ISDIR))
+    {
+        path = join(dir, ev->name);
+        while ((subdir = g_hash_table_find(watch_dirs, find_tree_watch,
+            path)))
+            drop_watch(GPOINTER_TO_INT(g_hash_table_lookup(watched, subdir)));
+        g_free(path);
+    }
+}
+
+static void *watch_thread(void *data)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(int))));
+    struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+
+    for (;;)
+    {
+        len = read(inotify_fd, buf, sizeof(buf));
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        pthread_rwlock_wrlock(&pathcache_lock);
+        generation++;
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len)
+        {
+            ev = (struct inotify_event *) p;
+            handle_event(ev);
+        }
+        pthread_rwlock_unlock(&pathcache_lock);
+    }
+
+    /* without events, the cache could go stale forever */
+    fprintf(stderr, "gstfs: lost inotify, not caching paths\n");
+    pthread_rwlock_wrlock(&pathcache_lock);
+    g_hash_table_remove_all(entries);
+    g_hash_table_remove_all(listings);
+    ttl_usecs = 0;
+    pthread_rwlock_unlock(&pathcache_lock);
+    return NULL;
+}
+
+/*
+ *  Start watching for changes.
+ */
+void pathcache_start(void)
+{
+    pthread_t thread;
+
+    if (!ttl_usecs)
+        return;
+
+    if (pthread_create(&thread, NULL, watch_thread, NULL))
+    {
+        fprintf(stderr, "gstfs: could not watch source, not caching\n");
+        ttl_usecs = 0;
+    }
+    else
+        pthread_detach(thread);
+}
+
+/*
+ *  Look up what path resolves to.  On a hit, si is filled in with a copy
+ *  of the entry; its path must be freed with g_free.  On a miss, only
+ *  si->generation is set, to be passed back to pathcache_store.
+ *
+ *  Returns true on a hit.
+ */
+int pathcache_lookup(const char *path, struct source_info *si)
+{
+    struct pathcache_entry *e = NULL;
+
+    pthread_rwlock_rdlock(&pathcache_lock);
+    if (ttl_usecs)
+        e = g_hash_table_lookup(entries, path);
+    if (e && e->expires > g_get_monotonic_time())
+    {
+        *si = e->si;
+        si->path = g_strdup(e->si.path);
+    }
+    else
+    {
+        si->generation = generation;
+        e = NULL;
+    }
+    pthread_rwlock_unlock(&pathcache_lock);
+    return e != NULL;
+}
+
+/*
+ *  Make sure changes in mount directory mount_dir, shown from source_dir,
+ *  are seen.  Returns 0 if they already were, 1 if the watch is new, so
+ *  that anything read before may be stale, or -1 if it can't be watched.
+ *
+ *  Called with pathcache_lock held for writing.
+ */
+static int watch(const char *mount_dir, const char *source_dir)
+{
+    const char *dir = profile_dir(mount_dir);
+    char *watch_dir;
+    int wd;
+
+    if (!dir)
+        return -1;
+    if (g_hash_table_lookup_extended(watched, dir, NULL, NULL))
+        return 0;
+
+    wd = inotify_add_watch(inotify_fd, source_dir, WATCH_MASK);
+    if (wd == -1)
+        return -1;
+
+    /* a directory we watch under another name, e.g. a symlink */
+    watch_dir = g_hash_table_lookup(watch_dirs, GINT_TO_POINTER(wd));
+    if (watch_dir)
+        return strcmp(watch_dir, dir) ? -1 : 0;
+
+    g_hash_table_insert(watch_dirs, GINT_TO_POINTER(wd), g_strdup(dir));
+    g_hash_table_insert(watched, g_strdup(dir), GINT_TO_POINTER(wd));
+    return 1;
+}
+
+/*
+ *  Remember what path resolves to, if its source directory is watched
+ *  and nothing changed since the lookup that missed.  Paths in directories
+ *  we only start watching now are cached from the next time on, as they
+ *  may have changed before the watch.
+ */
+void pathcache_store(const char *path, const struct source_info *si)
+{
+    struct pathcache_entry *e;
+    char *dir, *source_dir;
+    int ret;
+
+    pthread_rwlock_wrlock(&pathcache_lock);
+    if (!ttl_usecs || si->generation != generation)
+        goto out;
+
+    dir = g_path_get_dirname(path);
+    source_dir = g_path_get_dirname(si->path);
+    ret = watch(dir, source_dir);
+    g_free(source_dir);
+    g_free(dir);
+    if (ret)
+        goto out;
+
+    /* paths are cheap to resolve again, unlike transcodes */
+    if (g_hash_table_size(entries) >= PATHCACHE_MAX_ENTRIES)
+        g_hash_table_remove_all(entries);
+
+    e = g_new(struct pathcache_entry, 1);
+    e->si = *si;
+    e->si.path = g_strdup(si->path);
+    e->expires = g_get_monotonic_time() + ttl_usecs;
+    g_hash_table_replace(entries, g_strdup(path), e);
+
+out:
+    pthread_rwlock_unlock(&pathcache_lock);
+}
+
+/*
+ *  Look up the listing of mount directory path, shown from source_dir.
+ *  Returns a reference to it, to be dropped with pathcache_put_dir.
+ *
+ *  On a miss, returns NULL and starts watching source_dir, so that the
+ *  caller may read it and pass the listing and *generation to
+ *  pathcache_store_dir.
+ */
+struct dir_listing *pathcache_lookup_dir(const char *path,
+    const char *source_dir, unsigned *gen)
+{
+    struct pathcache_listing *l = NULL;
+    struct dir_listing *dl = NULL;
+
+    pthread_rwlock_rdlock(&pathcache_lock);
+    if (ttl_usecs)
+        l = g_hash_table_lookup(listings, path);
+    if (l && l->expires > g_get_monotonic_time())
+    {
+        dl = l->dl;
+        g_atomic_int_inc(&dl->refs);
+    }
+    pthread_rwlock_unlock(&pathcache_lock);
+
+    if (dl)
+        return dl;
+
+    pthread_rwlock_wrlock(&pathcache_lock);
+    if (ttl_usecs)
+        watch(path, source_dir);
+    *gen = generation;
+    pthread_rwlock_unlock(&pathcache_lock);
+    return NULL;
+}
+
+/*
+ *  Remember the listing of path, read since pathcache_lookup_dir returned
+ *  gen, unless anything changed since.
+ */
+void pathcache_store_dir(const char *path, struct dir_listing *dl,
+    unsigned gen)
+{
+    struct pathcache_listing *l;
+    const char *dir = profile_dir(path);
+
+    pthread_rwlock_wrlock(&pathcache_lock);
+    if (ttl_usecs && gen == generation && dir &&
+        g_hash_table_lookup_extended(watched, dir, NULL, NULL))
+    {
+        if (g_hash_table_size(listings) >= PATHCACHE_MAX_LISTINGS)
+            g_hash_table_remove_all(listings);
+
+        l = g_new(struct pathcache_listing, 1);
+        l->dl = dl;
+        l->expires = g_get_monotonic_time() + ttl_usecs;
+        g_atomic_int_inc(&dl->refs);
+        g_hash_table_replace(listings, g_strdup(path), l);
+    }
+    pthread_rwlock_unlock(&pathcache_lock);
+}
@@ -0,0 +1,40 @@
+#ifndef _PATHCACHE_H
+#define _PATHCACHE_H
+
+#include <sys/stat.h>
+
+/* what a path in the mount resolves to in the source mount */
+struct source_info
+{
+    char *path;                  /* file in the source mount */
+    int error;                   /* errno of stat'ing it, 0 if it exists */
+    struct stat stbuf;           /* its attributes, if it exists */
+    int transcoded;              /* the mount file is a transcode of it */
+    unsigned generation;         /* state of the cache it was resolved in */
+};
+
+/* a directory as shown in the mount */
+struct dir_entry
+{
+    char *name;                  /* name in the mount */
+    struct stat stbuf;           /* attributes of the source file */
+};
+
+struct dir_listing
+{
+    int refs;
+    size_t nentries;
+    struct dir_entry *entries;
+};
+
+void pathcache_init(int ttl);
+void pathcache_start(void);
+int pathcache_lookup(const char *path, struct source_info *si);
+void pathcache_store(const char *path, const struct source_info *si);
+struct dir_listing *pathcache_lookup_dir(const char *path,
+    const char *source_dir, unsigned *gen);
+void pathcache_store_dir(const char *path, struct dir_listing *dl,
+    unsigned gen);
+void pathcache_put_dir(struct dir_listing *dl);
+
+#endif /* _PATHCACHE_H */
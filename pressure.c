@@ -0,0 +1,198 @@
+/*
+ * gstfs - shrink the cache under memory pressure
+ *
+ * A thread reads the pressure stall information of the cgroup gstfs runs
+ * in, or of the whole system without one, and the cgroup's memory.events
+ * counters.  While tasks stall on memory, or the cgroup hits its high or
+ * max limit, the cache is held to a shrinking share of what it uses, so
+ * the evictor drops idle entries before the OOM killer drops gstfs.
+ * Once things are calm again the limit is raised bit by bit until it no
+ * longer matters.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <glib.h>
+#include "segbuf.h"
+#include "stats.h"
+#include "gstfs.h"
+
+/* seconds between looks at the pressure */
+#define PRESSURE_INTERVAL 2
+
+/* calm intervals in a row before the limit is raised again */
+#define PRESSURE_CALM_ROUNDS 5
+
+static char *psi_path;           /* memory.pressure or /proc/pressure/memory */
+static char *events_path;        /* the cgroup's memory.events, or NULL */
+static double threshold;         /* avg10 percentage that counts as pressure */
+
+/*
+ *  Return the cgroup v2 directory of this process, to be freed with
+ *  g_free, or NULL.
+ */
+static char *cgroup_dir(void)
+{
+    char line[4096];
+    char *dir = NULL;
+    FILE *f;
+
+    f = fopen("/proc/self/cgroup", "r");
+    if (!f)
+        return NULL;
+
+    while (!dir && fgets(line, sizeof(line), f))
+    {
+        if (strncmp(line, "0::", 3))
+            continue;
+        line[strcspn(line, "\n")] = 0;
+        dir = g_strdup_printf("/sys/fs/cgroup%s", line + 3);
+    }
+    fclose(f);
+    return dir;
+}
+
+/*
+ *  Return the share of the last 10 seconds some task stalled on memory,
+ *  in percent, or -1 if it can't be read.
+ */
+static double read_stall(void)
+{
+    char line[256];
+    double avg10 = -1;
+    FILE *f;
+
+    f = fopen(psi_path, "r");
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "some avg10=%lf", &avg10) == 1)
+            break;
+    }
+    fclose(f);
+    return avg10;
+}
+
+/*
+ *  Return the number of times the cgroup went over its high or max
+ *  memory limit so far, or 0 if it can't be read.
+ */
+static unsigned long long read_events(void)
+{
+    unsigned long long n, total = 0;
+    char line[256], name[64];
+    FILE *f;
+
+    if (!events_path || !(f = fopen(events_path, "r")))
+        return 0;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%63s %llu", name, &n) == 2 &&
+            (!strcmp(name, "high") || !strcmp(name, "max")))
+            total += n;
+    }
+    fclose(f);
+    return total;
+}
+
+static void *pressure_thread(void *data)
+{
+    unsigned long long events, last_events = read_events();
+    size_t limit = 0, bytes;
+    guint entries;
+    double stall;
+    int calm = 0;
+
+    for (;;)
+    {
+        sleep(PRESSURE_INTERVAL);
+
+        stall = read_stall();
+        events = read_events();
+        cache_usage(&entries, &bytes);
+
+        if (stall >= threshold || events != last_events)
+        {
+            /* take a quarter off whatever is smaller, use or limit */
+            if (!limit || bytes < limit)
+                limit = bytes;
+            limit = MAX(limit - limit / 4, 1);
+            cache_set_pressure_limit(limit);
+            segbuf_trim();
+            stats_add(STATS_PRESSURE_SHRINKS, 1);
+            calm = 0;
+        }
+        else if (limit && stall < threshold / 2 &&
+                 ++calm >= PRESSURE_CALM_ROUNDS)
+        {
+            limit += limit / 8 + SEGBUF_SEGMENT_SIZE;
+
+            /* done once the cache could double without reaching it */
+            if (limit >= 2 * bytes || (mount_info.max_cache_bytes &&
+                limit >= mount_info.max_cache_bytes))
+                limit = 0;
+            cache_set_pressure_limit(limit);
+            calm = 0;
+        }
+        last_events = events;
+    }
+    return NULL;
+}
+
+/*
+ *  Find where the memory pressure of this process can be read, to shrink
+ *  the cache once tasks stall on memory percent of the time.  Done before
+ *  fuse_main, so that the reason it isn't possible still reaches stderr.
+ *
+ *  Returns 0, or -1 if neither PSI nor memory.events are available.
+ */
+int pressure_init(int percent)
+{
+    char *dir = cgroup_dir();
+
+    threshold = percent;
+    if (dir)
+    {
+        psi_path = g_strdup_printf("%s/memory.pressure", dir);
+        events_path = g_strdup_printf("%s/memory.events", dir);
+        if (access(events_path, R_OK))
+        {
+            g_free(events_path);
+            events_path = NULL;
+        }
+        g_free(dir);
+    }
+
+    if (!psi_path || access(psi_path, R_OK))
+    {
+        g_free(psi_path);
+        psi_path = g_strdup("/proc/pressure/memory");
+    }
+
+    if (access(psi_path, R_OK) && !events_path)
+    {
+        fprintf(stderr, "gstfs: no memory pressure information, "
+            "pressure needs PSI or cgroup v2\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Start the thread watching the memory pressure found by pressure_init.
+ */
+void pressure_start(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, pressure_thread, NULL))
+        syslog(LOG_ERR, "could not start pressure monitor");
+    else
+        pthread_detach(thread);
+}
@@ -0,0 +1,182 @@
+/*
+ * gstfs - bounded pool of transcode workers
+ *
+ * Transcodes run on a fixed number of worker threads instead of on the
+ * FUSE thread that opened the file, so a burst of opens can't start an
+ * unbounded number of pipelines.  Interactive jobs are always picked
+ * before background ones.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <glib.h>
+#include "gstfs.h"
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static GQueue queues[SCHED_NPRIO];   /* pending jobs by priority */
+static GQueue tasks[SCHED_NPRIO];    /* pending sched_tasks by priority */
+static void (*run_job)(struct gstfs_file_info *);
+static int nslots;                   /* pipelines that may run at once */
+static int busy;                     /* slots taken by jobs or their parts */
+
+/* other work queued with sched_submit_task */
+struct sched_task
+{
+    void (*run)(void *);
+    void *data;
+};
+
+static void *worker_thread(void *data)
+{
+    struct gstfs_file_info *fi = NULL;
+    struct sched_task *task = NULL;
+    int prio;
+
+    pthread_mutex_lock(&sched_mutex);
+    for (;;)
+    {
+        for (prio = 0; busy < nslots && prio < SCHED_NPRIO && !fi && !task;
+             prio++)
+        {
+            if (!(fi = g_queue_pop_head(&queues[prio])))
+                task = g_queue_pop_head(&tasks[prio]);
+        }
+
+        if (!fi && !task)
+        {
+            pthread_cond_wait(&sched_cond, &sched_mutex);
+            continue;
+        }
+
+        if (fi)
+            fi->sched_node = NULL;
+        busy++;
+        pthread_mutex_unlock(&sched_mutex);
+
+        if (fi)
+            run_job(fi);
+        else
+        {
+            task->run(task->data);
+            g_free(task);
+        }
+        fi = NULL;
+        task = NULL;
+
+        pthread_mutex_lock(&sched_mutex);
+        busy--;
+    }
+    return NULL;
+}
+
+/*
+ *  Start nworkers threads running run for each submitted file.
+ */
+void sched_start(int nworkers, void (*run)(struct gstfs_file_info *))
+{
+    pthread_t thread;
+    int i;
+
+    run_job = run;
+    nslots = nworkers;
+    for (i = 0; i < nworkers; i++)
+    {
+        if (pthread_create(&thread, NULL, worker_thread, NULL))
+        {
+            fprintf(stderr, "gstfs: could not start transcode worker\n");
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/*
+ *  Queue a transcode of fi.  The caller has marked fi as transcoding,
+ *  which also keeps it from being evicted until the job has run.
+ */
+void sched_submit(struct gstfs_file_info *fi, int prio)
+{
+    pthread_mutex_lock(&sched_mutex);
+    g_queue_push_tail(&queues[prio], fi);
+    fi->sched_node = queues[prio].tail;
+    fi->sched_prio = prio;
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ *  Queue a call of run with data on a worker, behind the transcodes of
+ *  the same priority.
+ */
+void sched_submit_task(void (*run)(void *), void *data, int prio)
+{
+    struct sched_task *task = g_new(struct sched_task, 1);
+
+    task->run = run;
+    task->data = data;
+    pthread_mutex_lock(&sched_mutex);
+    g_queue_push_tail(&tasks[prio], task);
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ *  Take up to n slots that no job uses right now, for a job that runs
+ *  more than one pipeline.  Workers don't pick up new jobs while they
+ *  are taken.  Returns the number of slots taken, to be handed back with
+ *  sched_put_slots.
+ */
+int sched_take_slots(int n)
+{
+    pthread_mutex_lock(&sched_mutex);
+    n = MAX(MIN(n, nslots - busy), 0);
+    busy += n;
+    pthread_mutex_unlock(&sched_mutex);
+    return n;
+}
+
+void sched_put_slots(int n)
+{
+    pthread_mutex_lock(&sched_mutex);
+    busy -= n;
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ *  If fi is still waiting in a lower priority queue, move it up to prio
+ *  so that a job someone now waits on isn't stuck behind background work.
+ */
+void sched_promote(struct gstfs_file_info *fi, int prio)
+{
+    pthread_mutex_lock(&sched_mutex);
+    if (fi->sched_node && fi->sched_prio > prio)
+    {
+        g_queue_delete_link(&queues[fi->sched_prio], fi->sched_node);
+        g_queue_push_tail(&queues[prio], fi);
+        fi->sched_node = queues[prio].tail;
+        fi->sched_prio = prio;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ *  Take fi out of its queue if it hasn't been picked up yet, so that the
+ *  caller can run it along with another job.  fi stays marked as
+ *  transcoding.  Returns true if it was still queued.
+ */
+int sched_steal(struct gstfs_file_info *fi)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&sched_mutex);
+    if (fi->sched_node)
+    {
+        g_queue_delete_link(&queues[fi->sched_prio], fi->sched_node);
+        fi->sched_node = NULL;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return ret;
+}
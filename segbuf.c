@@ -0,0 +1,288 @@
+/*
+ * gstfs - segmented storage for transcoded files
+ *
+ * Output is kept in SEGBUF_SEGMENT_SIZE chunks so appending never copies
+ * or moves data that is already there.  Released segments are kept in a
+ * small pool for the next transcode.
+ *
+ * Alternatively, each buffer is backed by an unlinked file in a spill
+ * directory or a memfd, and its segments are shared mappings of it.  The
+ * kernel may then write out and drop cold data under memory pressure, and
+ * complete files can be spliced from the fd.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "segbuf.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+/* number of idle segments kept around for reuse */
+#define SEGBUF_POOL_MAX 16
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *pool[SEGBUF_POOL_MAX];
+static int pool_len;
+
+static const char *spill_dir;   /* directory of backing files, or NULL */
+static int use_memfd;           /* back buffers by memfds */
+
+/*
+ *  Choose where buffers keep their data: in files in spill_dir if given,
+ *  else in memfds if memfd is set, else in plain memory.
+ *
+ *  Returns 0, or -ENOSYS if memfds aren't available.
+ */
+int segbuf_init(const char *dir, int memfd)
+{
+    spill_dir = dir;
+#ifdef SYS_memfd_create
+    use_memfd = memfd;
+#else
+    if (memfd && !dir)
+        return -ENOSYS;
+#endif
+    return 0;
+}
+
+/*
+ *  Return a new, empty backing file, or -errno.
+ */
+static int open_backing()
+{
+    char path[PATH_MAX];
+    int fd;
+
+    if (spill_dir)
+    {
+        snprintf(path, sizeof(path), "%s/gstfs-XXXXXX", spill_dir);
+        fd = mkstemp(path);
+        if (fd == -1)
+            return -errno;
+
+        /* nothing else needs it, so evicting is just closing it */
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        return fd;
+    }
+
+#ifdef SYS_memfd_create
+    fd = syscall(SYS_memfd_create, "gstfs", MFD_CLOEXEC);
+    if (fd == -1)
+        return -errno;
+    return fd;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/*
+ *  Map the segment at offset of the backing file, allocating its blocks
+ *  first so that writing to it can't fail with SIGBUS.
+ */
+static char *map_segment(int fd, off_t offset, int *err)
+{
+    char *seg;
+
+    if ((*err = posix_fallocate(fd, offset, SEGBUF_SEGMENT_SIZE)))
+    {
+        *err = -*err;
+        return NULL;
+    }
+
+    seg = mmap(NULL, SEGBUF_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, offset);
+    if (seg == MAP_FAILED)
+    {
+        *err = -errno;
+        return NULL;
+    }
+    return seg;
+}
+
+static char *get_segment()
+{
+    char *seg = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_len)
+        seg = pool[--pool_len];
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (!seg)
+        seg = malloc(SEGBUF_SEGMENT_SIZE);
+    return seg;
+}
+
+static void put_segment(char *seg)
+{
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_len < SEGBUF_POOL_MAX)
+    {
+        pool[pool_len++] = seg;
+        seg = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    free(seg);
+}
+
+/*
+ *  Make sure the buffer can hold size bytes from its start.
+ *  Returns 0 on success or -errno, in which case the buffer is unchanged
+ *  apart from possibly having grown a bit.
+ */
+int segbuf_reserve(struct segbuf *sb, size_t size)
+{
+    size_t want = (size + SEGBUF_SEGMENT_SIZE - 1) / SEGBUF_SEGMENT_SIZE;
+    int err = -ENOMEM;
+
+    if (!sb->has_fd && (spill_dir || use_memfd) && want)
+    {
+        int fd = open_backing();
+
+        if (fd < 0)
+            return fd;
+        sb->fd = fd;
+        sb->has_fd = 1;
+    }
+
+    if (want > sb->max_segs)
+    {
+        size_t max_segs = sb->max_segs ? sb->max_segs * 2 : 8;
+        char **segs;
+
+        while (max_segs < want)
+            max_segs *= 2;
+
+        segs = realloc(sb->segs, max_segs * sizeof(char *));
+        if (!segs)
+            return -ENOMEM;
+
+        sb->segs = segs;
+        sb->max_segs = max_segs;
+    }
+
+    while (sb->nsegs < want)
+    {
+        char *seg;
+
+        if (sb->has_fd)
+            seg = map_segment(sb->fd,
+                (off_t) sb->nsegs * SEGBUF_SEGMENT_SIZE, &err);
+        else
+            seg = get_segment();
+        if (!seg)
+            return err;
+        sb->segs[sb->nsegs++] = seg;
+    }
+    return 0;
+}
+
+/*
+ *  Copy size bytes of data to offset, which must have been reserved.
+ */
+void segbuf_write(struct segbuf *sb, size_t offset, const char *data,
+    size_t size)
+{
+    while (size)
+    {
+        size_t seg_off = offset % SEGBUF_SEGMENT_SIZE;
+        size_t count = min(size, SEGBUF_SEGMENT_SIZE - seg_off);
+
+        memcpy(sb->segs[offset / SEGBUF_SEGMENT_SIZE] + seg_off, data, count);
+        data += count;
+        offset += count;
+        size -= count;
+    }
+}
+
+/*
+ *  Copy size bytes from offset into buf, crossing segments as needed.
+ */
+void segbuf_read(const struct segbuf *sb, size_t offset, char *buf,
+    size_t size)
+{
+    while (size)
+    {
+        size_t seg_off = offset % SEGBUF_SEGMENT_SIZE;
+        size_t count = min(size, SEGBUF_SEGMENT_SIZE - seg_off);
+
+        memcpy(buf, sb->segs[offset / SEGBUF_SEGMENT_SIZE] + seg_off, count);
+        buf += count;
+        offset += count;
+        size -= count;
+    }
+}
+
+/*
+ *  Number of bytes held by the buffer's segments.
+ */
+size_t segbuf_alloc_len(const struct segbuf *sb)
+{
+    return sb->nsegs * SEGBUF_SEGMENT_SIZE;
+}
+
+/*
+ *  Return the file the buffer is stored in, or -1 if it is in memory.
+ */
+int segbuf_fd(const struct segbuf *sb)
+{
+    return sb->has_fd ? sb->fd : -1;
+}
+
+/*
+ *  Free the idle segments of the pool and let malloc hand the memory it
+ *  no longer uses back to the system, e.g. under memory pressure.
+ */
+void segbuf_trim(void)
+{
+    char *segs[SEGBUF_POOL_MAX];
+    int i, n;
+
+    pthread_mutex_lock(&pool_mutex);
+    n = pool_len;
+    memcpy(segs, pool, n * sizeof(char *));
+    pool_len = 0;
+    pthread_mutex_unlock(&pool_mutex);
+
+    for (i = 0; i < n; i++)
+        free(segs[i]);
+    malloc_trim(0);
+}
+
+/*
+ *  Give all segments back to the pool, or drop the backing file, and
+ *  empty the buffer.
+ */
+void segbuf_release(struct segbuf *sb)
+{
+    size_t i;
+
+    for (i = 0; i < sb->nsegs; i++)
+    {
+        if (sb->has_fd)
+            munmap(sb->segs[i], SEGBUF_SEGMENT_SIZE);
+        else
+            put_segment(sb->segs[i]);
+    }
+    if (sb->has_fd)
+        close(sb->fd);
+
+    free(sb->segs);
+    memset(sb, 0, sizeof(*sb));
+}
@@ -0,0 +1,29 @@
+#ifndef _SEGBUF_H
+#define _SEGBUF_H
+
+#include <stddef.h>
+
+#define SEGBUF_SEGMENT_SIZE (1024 * 1024)
+
+/* growable buffer made of fixed-size segments that never move */
+struct segbuf
+{
+    char **segs;              /* segments in file order */
+    size_t nsegs;             /* number of segments in use */
+    size_t max_segs;          /* allocated size of segs */
+    int fd;                   /* file the segments are mapped from */
+    int has_fd;               /* fd is valid */
+};
+
+int segbuf_init(const char *spill_dir, int memfd);
+int segbuf_reserve(struct segbuf *sb, size_t size);
+void segbuf_write(struct segbuf *sb, size_t offset, const char *data,
+    size_t size);
+void segbuf_read(const struct segbuf *sb, size_t offset, char *buf,
+    size_t size);
+size_t segbuf_alloc_len(const struct segbuf *sb);
+int segbuf_fd(const struct segbuf *sb);
+void segbuf_release(struct segbuf *sb);
+void segbuf_trim(void);
+
+#endif /* _SEGBUF_H */
@@ -0,0 +1,101 @@
+/*
+ * gstfs - persistent index of transcoded file sizes
+ *
+ * The index is a text file of "<key> <size>" lines, keyed like the disk
+ * cache.  It is read into memory at mount time and appended to whenever a
+ * transcode completes; later lines win over earlier ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <glib.h>
+#include "sizeindex.h"
+
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *sizes;            /* key -> size, as a g_malloc'd size_t */
+static FILE *index_file;             /* opened for appending */
+
+/*
+ *  Load the index at path and open it for appending, creating it if
+ *  needed.  Malformed lines, e.g. left by a crash, are skipped.
+ *
+ *  Returns 0 on success, or -errno.
+ */
+int sizeindex_open(const char *path)
+{
+    char line[256];
+    char key[128];
+    unsigned long long size;
+    FILE *f;
+
+    sizes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    f = fopen(path, "r");
+    if (f)
+    {
+        while (fgets(line, sizeof(line), f))
+        {
+            size_t *value;
+
+            if (sscanf(line, "%127s %llu", key, &size) != 2)
+                continue;
+
+            value = g_new(size_t, 1);
+            *value = size;
+            g_hash_table_replace(sizes, g_strdup(key), value);
+        }
+        fclose(f);
+    }
+
+    index_file = fopen(path, "a");
+    if (!index_file)
+        return -errno;
+
+    setvbuf(index_file, NULL, _IOLBF, 0);
+    return 0;
+}
+
+/*
+ *  Look up the transcoded size recorded for key.
+ *  Returns 1 and sets *size if found, 0 otherwise.
+ */
+int sizeindex_lookup(const char *key, size_t *size)
+{
+    size_t *value = NULL;
+
+    pthread_mutex_lock(&index_mutex);
+    if (sizes)
+        value = g_hash_table_lookup(sizes, key);
+    if (value)
+        *size = *value;
+    pthread_mutex_unlock(&index_mutex);
+
+    return value != NULL;
+}
+
+/*
+ *  Record the transcoded size for key.
+ */
+void sizeindex_store(const char *key, size_t size)
+{
+    size_t *value;
+
+    pthread_mutex_lock(&index_mutex);
+    if (!index_file)
+        goto out;
+
+    value = g_hash_table_lookup(sizes, key);
+    if (value && *value == size)
+        goto out;
+
+    value = g_new(size_t, 1);
+    *value = size;
+    g_hash_table_replace(sizes, g_strdup(key), value);
+
+    fprintf(index_file, "%s %llu\n", key, (unsigned long long) size);
+out:
+    pthread_mutex_unlock(&index_mutex);
+}
@@ -0,0 +1,10 @@
+#ifndef _SIZEINDEX_H
+#define _SIZEINDEX_H
+
+#include <stddef.h>
+
+int sizeindex_open(const char *path);
+int sizeindex_lookup(const char *key, size_t *size);
+void sizeindex_store(const char *key, size_t size);
+
+#endif /* _SIZEINDEX_H */
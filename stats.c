@@ -0,0 +1,125 @@
+/*
+ * gstfs - counters and latency histograms
+ *
+ * These are reported through the virtual /.gstfs/stats file.  Histograms
+ * have power of two buckets in milliseconds and are printed cumulatively,
+ * i.e. each bucket counts the samples at or below its bound.
+ *
+ * Everything is updated with atomic adds rather than under a lock, as
+ * reads and opens on all threads report here.  A report taken while
+ * samples come in may be a sample off between a histogram's fields.
+ */
+
+#include <stdio.h>
+#include <glib.h>
+#include "stats.h"
+
+#define STATS_BUCKETS 17             /* 1ms .. 32s, then everything else */
+
+struct stats_histogram
+{
+    guint64 buckets[STATS_BUCKETS];
+    guint64 count;
+    guint64 sum_ms;
+};
+
+/* read a 64 bit value atomically, even on 32 bit hosts */
+#define STATS_LOAD(v) __sync_add_and_fetch(&(v), 0)
+
+static gint64 counters[STATS_NCOUNTERS];
+static struct stats_histogram histograms[STATS_NHISTOGRAMS];
+
+static const char *counter_names[STATS_NCOUNTERS] = {
+    "open_memory",
+    "open_disk",
+    "open_joined",
+    "open_miss",
+    "open_passthrough",
+    "open_failed",
+    "evictions",
+    "invalidations",
+    "pressure_shrinks",
+    "transcodes_running",
+    "transcodes_done",
+    "transcodes_failed",
+    "transcodes_shared",
+    "seeks",
+    "shared_fetches",
+    "bytes_memory",
+    "bytes_disk",
+    "bytes_passthrough",
+    "path_hits",
+    "path_misses",
+};
+
+static const char *histogram_names[STATS_NHISTOGRAMS] = {
+    "parse_ms",
+    "first_buffer_ms",
+    "transcode_ms",
+};
+
+/*
+ *  Add n, which may be negative, to a counter.
+ */
+void stats_add(int counter, gint64 n)
+{
+    __sync_fetch_and_add(&counters[counter], n);
+}
+
+/*
+ *  Record a sample of usecs in a histogram.
+ */
+void stats_time(int histogram, gint64 usecs)
+{
+    struct stats_histogram *h = &histograms[histogram];
+    gint64 ms = usecs / 1000;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS - 1 && ms > (1 << i); i++)
+        ;
+
+    __sync_fetch_and_add(&h->buckets[i], 1);
+    __sync_fetch_and_add(&h->count, 1);
+    __sync_fetch_and_add(&h->sum_ms, ms);
+}
+
+/*
+ *  Return the contents of the stats file as "name value" lines, given the
+ *  current size of the cache.  The result must be freed with g_free.
+ */
+char *stats_format(guint entries, size_t bytes)
+{
+    GString *out = g_string_new(NULL);
+    int i, j;
+
+    g_string_append_printf(out, "cache_entries %u\n", entries);
+    g_string_append_printf(out, "cache_bytes %lu\n", (unsigned long) bytes);
+
+    for (i = 0; i < STATS_NCOUNTERS; i++)
+        g_string_append_printf(out, "%s %lld\n", counter_names[i],
+            (long long) STATS_LOAD(counters[i]));
+
+    for (i = 0; i < STATS_NHISTOGRAMS; i++)
+    {
+        struct stats_histogram *h = &histograms[i];
+        guint64 total = 0;
+
+        g_string_append_printf(out, "%s_count %llu\n", histogram_names[i],
+            (unsigned long long) STATS_LOAD(h->count));
+        g_string_append_printf(out, "%s_sum %llu\n", histogram_names[i],
+            (unsigned long long) STATS_LOAD(h->sum_ms));
+
+        for (j = 0; j < STATS_BUCKETS; j++)
+        {
+            total += STATS_LOAD(h->buckets[j]);
+            if (j < STATS_BUCKETS - 1)
+                g_string_append_printf(out, "%s_le_%d %llu\n",
+                    histogram_names[i], 1 << j, (unsigned long long) total);
+            else
+                g_string_append_printf(out, "%s_le_inf %llu\n",
+                    histogram_names[i], (unsigned long long) total);
+        }
+    }
+
+    return g_string_free(out, FALSE);
+}
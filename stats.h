@@ -0,0 +1,46 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h>
+#include <glib.h>
+
+/* event counters */
+enum
+{
+    STATS_OPEN_MEMORY,           /* opens of files complete in memory */
+    STATS_OPEN_DISK,             /* opens served from cache_dir */
+    STATS_OPEN_JOINED,           /* opens of files already transcoding */
+    STATS_OPEN_MISS,             /* opens that started a transcode */
+    STATS_OPEN_PASSTHROUGH,      /* opens of files not transcoded */
+    STATS_OPEN_FAILED,           /* opens refused after a failed transcode */
+    STATS_EVICTIONS,             /* entries dropped from the cache */
+    STATS_INVALIDATIONS,         /* entries dropped as their source changed */
+    STATS_PRESSURE_SHRINKS,      /* cuts of the cache under memory pressure */
+    STATS_TRANSCODES_RUNNING,    /* transcodes in flight */
+    STATS_TRANSCODES_DONE,       /* transcodes completed */
+    STATS_TRANSCODES_FAILED,     /* transcodes that failed or were refused */
+    STATS_TRANSCODES_SHARED,     /* transcodes sharing another's decode */
+    STATS_SEEKS,                 /* transcodes started for reads far ahead */
+    STATS_SHARED_FETCHES,        /* entries another host transcoded */
+    STATS_BYTES_MEMORY,          /* bytes read from transcoded data */
+    STATS_BYTES_DISK,            /* bytes read from cache_dir */
+    STATS_BYTES_PASSTHROUGH,     /* bytes read from source files */
+    STATS_PATH_HITS,             /* paths resolved from the path cache */
+    STATS_PATH_MISSES,           /* paths resolved by stat'ing the source */
+    STATS_NCOUNTERS
+};
+
+/* latency histograms */
+enum
+{
+    STATS_PARSE,                 /* parsing a pipeline */
+    STATS_FIRST_BUFFER,          /* start of a transcode to its first data */
+    STATS_TRANSCODE,             /* whole transcode */
+    STATS_NHISTOGRAMS
+};
+
+void stats_add(int counter, gint64 n);
+void stats_time(int histogram, gint64 usecs);
+char *stats_format(guint entries, size_t bytes);
+
+#endif /* _STATS_H */
@@ -0,0 +1,24 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ *  Static tracepoints of provider gstfs, e.g. for bpftrace -l
+ *  'usdt:./gstfs:gstfs:*' or perf probe sdt_gstfs:*.  They are only built
+ *  in with ./configure --enable-tracing, and are a nop until attached to;
+ *  otherwise they and their arguments compile to nothing.
+ */
+#include "config.h"
+
+#ifdef ENABLE_TRACING
+#include <sys/sdt.h>
+
+#define TRACE1(name, a)             DTRACE_PROBE1(gstfs, name, a)
+#define TRACE2(name, a, b)          DTRACE_PROBE2(gstfs, name, a, b)
+#define TRACE3(name, a, b, c)       DTRACE_PROBE3(gstfs, name, a, b, c)
+#else
+#define TRACE1(name, a)             do { } while (0)
+#define TRACE2(name, a, b)          do { } while (0)
+#define TRACE3(name, a, b, c)       do { } while (0)
+#endif
+
+#endif /* _TRACE_H */
@@ -3,61 +3,236 @@
  */
 
 #include <gst/gst.h>
+#include <gst/app/gstappsink.h>
 #include <glib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include "xcode.h"
+#include "stats.h"
+#include "trace.h"
+
+/* idle pipelines kept per pipeline string */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *pool;
+static int pool_size = 4;
 
 struct pipe_params
 {
+    const char *filename;     /* source, for the probes */
     int fd;
-    void (*add_data_cb)(char *, size_t, void *);
+    int (*add_data_cb)(char *, size_t, void *);
     void *user_data;
+    int ret;                  /* first error returned by add_data_cb */
 };
 
 void *send_pipe(void *data)
 {
     struct pipe_params *param = (struct pipe_params *) data;
     char buf[PIPE_BUF];
-    size_t sizeread;
+    ssize_t sizeread;
     
     while ((sizeread = read(param->fd, buf, sizeof(buf))) > 0)
     {
-        param->add_data_cb(buf, sizeread, param->user_data);
+        TRACE2(buffer, param->filename, sizeread);
+
+        /* once the consumer refused data, just drain the pipe */
+        if (!param->ret)
+            param->ret = param->add_data_cb(buf, sizeread, param->user_data);
+        TRACE3(buffer_done, param->filename, sizeread, param->ret);
     }
     return NULL;
 }
 
 /*
- *  Transcodes a file into a buffer, blocking until done.
+ *  Set the number of parsed pipelines kept for reuse per pipeline string.
+ *  Must be called before the first transcode.
  */
-int gstfs_transcode(char *pipeline_str, char *filename, 
-    void (*add_data_cb)(char *, size_t, void *), void *user_data)
+void gstfs_transcode_set_pool_size(int npipelines)
 {
-    GstElement *pipeline, *source, *dest;
+    pool_size = npipelines;
+}
+
+/*
+ *  Return whether an element of pipeline has sometimes pads, as decodebin
+ *  or a demuxer do.  gst_parse_launch links those only once, when they
+ *  first appear, and they are gone again after going back to NULL, so
+ *  such a pipeline must not be reused.
+ */
+static int has_sometimes_pads(GstElement *pipeline)
+{
+    GstIterator *it = gst_bin_iterate_recurse(GST_BIN(pipeline));
+    GList *templates;
+    gpointer item;
+    int found = 0;
+    int done = 0;
+
+    while (!found && !done)
+    {
+        switch (gst_iterator_next(it, &item))
+        {
+        case GST_ITERATOR_OK:
+            templates = gst_element_class_get_pad_template_list(
+                GST_ELEMENT_GET_CLASS(item));
+            for (; templates && !found; templates = templates->next)
+                found = (GST_PAD_TEMPLATE_PRESENCE(templates->data) ==
+                    GST_PAD_SOMETIMES);
+            gst_object_unref(item);
+            break;
+        case GST_ITERATOR_RESYNC:
+            gst_iterator_resync(it);
+            break;
+        case GST_ITERATOR_ERROR:
+            /* assume the worst rather than reuse a broken pipeline */
+            found = 1;
+            break;
+        default:
+            done = 1;
+            break;
+        }
+    }
+    gst_iterator_free(it);
+    return found;
+}
+
+/*
+ *  Return an idle pipeline for pipeline_str in the NULL state, parsing a
+ *  new one if none is available.  Pooled pipelines are keyed by the
+ *  pipeline_str pointer's contents, so it must outlive the pool.
+ */
+static GstElement *get_pipeline(const char *pipeline_str)
+{
+    GstElement *pipeline = NULL;
     GError *error = NULL;
-    GstBus *bus;
-    int pipefds[2];
+    GSList *idle;
+    gint64 start;
 
-    struct pipe_params thread_params;
-    pthread_t thread;
-    void *thread_status;
+    pthread_mutex_lock(&pool_mutex);
+    if (pool && (idle = g_hash_table_lookup(pool, pipeline_str)))
+    {
+        pipeline = idle->data;
+        g_hash_table_replace(pool, (gpointer) pipeline_str,
+            g_slist_delete_link(idle, idle));
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (pipeline)
+    {
+        TRACE1(pool_hit, pipeline_str);
+        return pipeline;
+    }
 
+    TRACE1(parse_start, pipeline_str);
+    start = g_get_monotonic_time();
     pipeline = gst_parse_launch(pipeline_str, &error);
+    stats_time(STATS_PARSE, g_get_monotonic_time() - start);
+    TRACE2(parse_done, pipeline_str, error == NULL);
     if (error)
     {
         fprintf(stderr, "Error parsing pipeline: %s\n", error->message);
-        return -1;
+        g_error_free(error);
+        if (pipeline)
+            gst_object_unref(pipeline);
+        return NULL;
     }
 
-    source = gst_bin_get_by_name(GST_BIN(pipeline), "_source");
-    dest = gst_bin_get_by_name(GST_BIN(pipeline), "_dest");
+    if (!has_sometimes_pads(pipeline))
+        g_object_set_data(G_OBJECT(pipeline), "gstfs-poolable",
+            GINT_TO_POINTER(1));
+    return pipeline;
+}
 
-    if (!pipeline || !source || !dest) 
+/*
+ *  Hand a pipeline in the NULL state back to the pool, or drop it if it
+ *  can't be reused or the pool for its pipeline string is full.
+ */
+static void put_pipeline(const char *pipeline_str, GstElement *pipeline)
+{
+    GSList *idle;
+
+    if (!g_object_get_data(G_OBJECT(pipeline), "gstfs-poolable"))
     {
-        fprintf(stderr, "Could not initialize pipeline\n");
-        return -2;
+        gst_object_unref(pipeline);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    if (!pool)
+        pool = g_hash_table_new(g_str_hash, g_str_equal);
+
+    idle = g_hash_table_lookup(pool, pipeline_str);
+    if (g_slist_length(idle) < pool_size)
+    {
+        g_hash_table_replace(pool, (gpointer) pipeline_str,
+            g_slist_prepend(idle, pipeline));
+        pipeline = NULL;
     }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (pipeline)
+        gst_object_unref(pipeline);
+}
+
+/*
+ *  Bus sync handler for appsink pipelines.  An error stops the streaming
+ *  thread without ever reaching the appsink, so hand it an EOS to make
+ *  gst_app_sink_pull_buffer return.
+ */
+static GstBusSyncReply appsink_bus_handler(GstBus *bus, GstMessage *message,
+    gpointer data)
+{
+    GstElement *dest = (GstElement *) data;
+    GstPad *pad;
+
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR)
+    {
+        pad = gst_element_get_static_pad(dest, "sink");
+        gst_pad_send_event(pad, gst_event_new_eos());
+        gst_object_unref(pad);
+    }
+    return GST_BUS_PASS;
+}
+
+/*
+ *  Pull buffers straight out of an appsink _dest and hand their data to
+ *  add_data_cb, without a pipe or an extra thread in between.
+ */
+static int transcode_appsink(const char *filename, GstElement *pipeline,
+    GstElement *dest, GstBus *bus, int (*add_data_cb)(char *, size_t, void *),
+    void *user_data)
+{
+    GstBuffer *buffer;
+    int ret = 0;
+
+    gst_bus_set_sync_handler(bus, appsink_bus_handler, dest);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    /* returns NULL on EOS */
+    while (!ret && (buffer = gst_app_sink_pull_buffer(GST_APP_SINK(dest))))
+    {
+        TRACE2(buffer, filename, GST_BUFFER_SIZE(buffer));
+        ret = add_data_cb((char *) GST_BUFFER_DATA(buffer),
+            GST_BUFFER_SIZE(buffer), user_data);
+        TRACE3(buffer_done, filename, GST_BUFFER_SIZE(buffer), ret);
+        gst_buffer_unref(buffer);
+    }
+    return ret;
+}
+
+/*
+ *  Feed an fdsink _dest into a pipe, drained by a helper thread that hands
+ *  the data to add_data_cb.  *error is set if the pipeline stopped on an
+ *  error rather than EOS, as that message is taken off the bus here.
+ */
+static int transcode_fdsink(const char *filename, GstElement *pipeline,
+    GstElement *dest, GstBus *bus, int (*add_data_cb)(char *, size_t, void *),
+    void *user_data, int *error)
+{
+    int pipefds[2];
+
+    struct pipe_params thread_params;
+    pthread_t thread;
 
     if (pipe(pipefds))
     {
@@ -65,25 +240,446 @@ int gstfs_transcode(char *pipeline_str, char *filename,
         return -1;
     }
 
+    thread_params.filename = filename;
     thread_params.fd = pipefds[0];
     thread_params.add_data_cb = add_data_cb;
     thread_params.user_data = user_data;
+    thread_params.ret = 0;
 
     pthread_create(&thread, NULL, send_pipe, (void *) &thread_params); 
 
-    g_object_set(G_OBJECT(source), "location", filename, NULL);
     g_object_set(G_OBJECT(dest), "fd", pipefds[1], NULL);
 
-    bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
-    gst_bus_add_signal_watch(bus);
     gst_element_set_state(pipeline, GST_STATE_PLAYING);
-    GstMessage *message = gst_bus_poll(bus, GST_MESSAGE_EOS | 
-        GST_MESSAGE_ERROR, -1);
+    GstMessage *message = gst_bus_timed_pop_filtered(bus,
+        GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    *error = (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR);
     gst_message_unref(message); 
+    TRACE1(pipe_drain, filename);
 
-    // close read-side so pipe will terminate
+    // stop writing and close write-side so pipe will terminate
+    gst_element_set_state(pipeline, GST_STATE_NULL);
     close(pipefds[1]);
-    pthread_join(thread, thread_status);
+    pthread_join(thread, NULL);
+    close(pipefds[0]);
+    TRACE1(pipe_drained, filename);
+
+    return thread_params.ret;
+}
+
+/*
+ *  Transcodes a file into a buffer, blocking until done.
+ *
+ *  _dest may either be an fdsink, which is fed through a pipe drained by
+ *  a helper thread, or an appsink, which is pulled from directly.
+ *
+ *  Returns 0 on success, the first error returned by add_data_cb, or
+ *  -EIO if the pipeline failed.
+ */
+int gstfs_transcode(char *pipeline_str, char *filename, 
+    int (*add_data_cb)(char *, size_t, void *), void *user_data)
+{
+    GstElement *pipeline, *source, *dest;
+    GstMessage *message;
+    GstBus *bus;
+    int failed;
+    int error = 0;
+    int ret;
+
+    TRACE1(transcode_start, filename);
+    pipeline = get_pipeline(pipeline_str);
+    if (!pipeline)
+        return -1;
+
+    source = gst_bin_get_by_name(GST_BIN(pipeline), "_source");
+    dest = gst_bin_get_by_name(GST_BIN(pipeline), "_dest");
+
+    if (!source || !dest) 
+    {
+        fprintf(stderr, "Could not initialize pipeline\n");
+        if (source)
+            gst_object_unref(source);
+        if (dest)
+            gst_object_unref(dest);
+        gst_object_unref(pipeline);
+        return -2;
+    }
+
+    g_object_set(G_OBJECT(source), "location", filename, NULL);
+
+    bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+    if (GST_IS_APP_SINK(dest))
+        ret = transcode_appsink(filename, pipeline, dest, bus, add_data_cb,
+            user_data);
+    else
+        ret = transcode_fdsink(filename, pipeline, dest, bus, add_data_cb,
+            user_data, &error);
+
+    /*
+     * An fdsink pipeline's error was taken off the bus already; an appsink
+     * one's is still there, as going to NULL only flushes it below.
+     */
+    message = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+    failed = error || message != NULL;
+    if (message)
+        gst_message_unref(message);
+    if (failed && !ret)
+        ret = -EIO;
+
+    /* also stops the pipeline if add_data_cb gave up early */
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_bus_set_sync_handler(bus, NULL, NULL);
+    gst_object_unref(bus);
+    gst_object_unref(source);
+    gst_object_unref(dest);
+
+    /* a pipeline that errored out may be in a bad state, don't reuse it */
+    if (failed)
+        gst_object_unref(pipeline);
+    else
+        put_pipeline(pipeline_str, pipeline);
+
+    TRACE2(transcode_done, filename, ret);
+    return ret;
+}
+
+/*
+ *  Transcodes the part of a file from start to stop, in nanoseconds of
+ *  the source, stop being -1 for the end.  _dest must be an appsink.
+ *
+ *  Decoding starts margin before start so that the encoder has settled
+ *  by then, and only buffers stamped from start to stop are handed to
+ *  add_data_cb: the output of the encoder's priming is dropped, and as
+ *  the transcode stops at the first buffer past stop, so is its padding.
+ *  Buffers without a timestamp go with the one before them, or with the
+ *  start of the file.
+ *
+ *  Returns like gstfs_transcode.
+ */
+int gstfs_transcode_range(char *pipeline_str, char *filename,
+    long long start, long long stop, long long margin,
+    int (*add_data_cb)(char *, size_t, void *), void *user_data)
+{
+    GstElement *pipeline, *source, *dest;
+    GstClockTime ts;
+    GstBuffer *buffer;
+    GstMessage *message;
+    GstBus *bus;
+    int keep = (start == 0);
+    int failed = 0;
+    int ret = 0;
+
+    TRACE3(range_start, filename, start, stop);
+    pipeline = get_pipeline(pipeline_str);
+    if (!pipeline)
+        return -1;
+
+    source = gst_bin_get_by_name(GST_BIN(pipeline), "_source");
+    dest = gst_bin_get_by_name(GST_BIN(pipeline), "_dest");
+
+    if (!source || !dest || !GST_IS_APP_SINK(dest))
+    {
+        fprintf(stderr, "Could not initialize pipeline\n");
+        if (source)
+            gst_object_unref(source);
+        if (dest)
+            gst_object_unref(dest);
+        gst_object_unref(pipeline);
+        return -2;
+    }
+
+    g_object_set(G_OBJECT(source), "location", filename, NULL);
+
+    bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+    gst_bus_set_sync_handler(bus, appsink_bus_handler, dest);
+
+    /* the source can only be seeked once it is prerolled */
+    if (start > 0)
+    {
+        gst_element_set_state(pipeline, GST_STATE_PAUSED);
+        failed = (gst_element_get_state(pipeline, NULL, NULL,
+            10 * GST_SECOND) != GST_STATE_CHANGE_SUCCESS);
+        TRACE2(prerolled, filename, !failed);
+        failed = failed ||
+            !gst_element_seek(pipeline, 1.0, GST_FORMAT_TIME,
+                GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE,
+                GST_SEEK_TYPE_SET, start > margin ? start - margin : 0,
+                GST_SEEK_TYPE_NONE, -1);
+        TRACE2(seeked, filename, !failed);
+    }
+
+    if (!failed)
+    {
+        gst_element_set_state(pipeline, GST_STATE_PLAYING);
+        while (!ret &&
+            (buffer = gst_app_sink_pull_buffer(GST_APP_SINK(dest))))
+        {
+            ts = GST_BUFFER_TIMESTAMP(buffer);
+            if (GST_CLOCK_TIME_IS_VALID(ts))
+            {
+                if (stop >= 0 && ts >= (GstClockTime) stop)
+                {
+                    gst_buffer_unref(buffer);
+                    break;
+                }
+                keep = (ts >= (GstClockTime) start);
+            }
+
+            TRACE2(buffer, filename, GST_BUFFER_SIZE(buffer));
+            if (keep)
+                ret = add_data_cb((char *) GST_BUFFER_DATA(buffer),
+                    GST_BUFFER_SIZE(buffer), user_data);
+            TRACE3(buffer_done, filename, keep ? GST_BUFFER_SIZE(buffer) : 0,
+                ret);
+            gst_buffer_unref(buffer);
+        }
+    }
+
+    message = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+    if (message)
+    {
+        failed = 1;
+        gst_message_unref(message);
+    }
+    if (failed && !ret)
+        ret = -EIO;
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_bus_set_sync_handler(bus, NULL, NULL);
+    gst_object_unref(bus);
+    gst_object_unref(source);
+    gst_object_unref(dest);
+
+    if (failed)
+        gst_object_unref(pipeline);
+    else
+        put_pipeline(pipeline_str, pipeline);
+
+    TRACE2(transcode_done, filename, ret);
+    return ret;
+}
+
+/* one encoder of a tee pipeline */
+struct tee_branch
+{
+    const char *filename;     /* source, for the probes */
+    GstElement *dest;
+    int (*add_data_cb)(char *, size_t, void *);
+    void *user_data;
+    int ret;                  /* first error returned by add_data_cb */
+    gint *live;               /* # of branches still taking data */
+    GstElement **sinks;       /* NULL terminated _dest%d of all branches */
+};
+
+/*
+ *  Hand an EOS to every appsink of a NULL terminated array, to make
+ *  gst_app_sink_pull_buffer return.
+ */
+static void send_eos(GstElement **sinks)
+{
+    GstPad *pad;
+
+    for (; *sinks; sinks++)
+    {
+        pad = gst_element_get_static_pad(*sinks, "sink");
+        gst_pad_send_event(pad, gst_event_new_eos());
+        gst_object_unref(pad);
+    }
+}
+
+static GstBusSyncReply tee_bus_handler(GstBus *bus, GstMessage *message,
+    gpointer data)
+{
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR)
+        send_eos((GstElement **) data);
+    return GST_BUS_PASS;
+}
+
+/*
+ *  Pull a branch's appsink until EOS.  A branch whose consumer gave up
+ *  keeps draining, as the tee would stall the other branches otherwise,
+ *  until all of them gave up.
+ */
+static void *pull_branch(void *data)
+{
+    struct tee_branch *b = (struct tee_branch *) data;
+    GstBuffer *buffer;
+
+    while ((buffer = gst_app_sink_pull_buffer(GST_APP_SINK(b->dest))))
+    {
+        TRACE2(buffer, b->filename, GST_BUFFER_SIZE(buffer));
+        if (!b->ret)
+        {
+            b->ret = b->add_data_cb((char *) GST_BUFFER_DATA(buffer),
+                GST_BUFFER_SIZE(buffer), b->user_data);
+            if (b->ret && g_atomic_int_dec_and_test(b->live))
+                send_eos(b->sinks);
+        }
+        TRACE3(buffer_done, b->filename, GST_BUFFER_SIZE(buffer), b->ret);
+        gst_buffer_unref(buffer);
+    }
+    return NULL;
+}
+
+/*
+ *  Transcodes a file into nsinks buffers at once, decoding it only once.
+ *  The pipeline must have appsinks named _dest0 to _dest<nsinks-1>, the
+ *  data of _dest<i> being handed to add_data_cb with user_data[i].  Each
+ *  appsink is pulled by its own thread, so that a slow encoder only holds
+ *  up the others as far as the queues in front of them fill up.
+ *
+ *  rets[i] is set to 0 on success, the first error returned by add_data_cb
+ *  for that sink, or -EIO if the pipeline failed.
+ */
+void gstfs_transcode_tee(char *pipeline_str, char *filename, int nsinks,
+    int (*add_data_cb)(char *, size_t, void *), void **user_data, int *rets)
+{
+    GstElement *pipeline, *source, **sinks;
+    struct tee_branch *branches;
+    pthread_t *threads;
+    GstMessage *message;
+    GstBus *bus;
+    gint live = nsinks;
+    int i, n, ok, failed;
+
+    TRACE2(tee_start, filename, nsinks);
+    pipeline = get_pipeline(pipeline_str);
+    if (!pipeline)
+    {
+        for (i = 0; i < nsinks; i++)
+            rets[i] = -1;
+        return;
+    }
+
+    source = gst_bin_get_by_name(GST_BIN(pipeline), "_source");
+    sinks = g_new0(GstElement *, nsinks + 1);
+    ok = (source != NULL);
+    for (i = 0; i < nsinks; i++)
+    {
+        char *name = g_strdup_printf("_dest%d", i);
+
+        sinks[i] = gst_bin_get_by_name(GST_BIN(pipeline), name);
+        g_free(name);
+        if (!sinks[i])
+            break;
+        if (!GST_IS_APP_SINK(sinks[i]))
+            ok = 0;
+    }
+
+    if (!ok || i < nsinks)
+    {
+        fprintf(stderr, "Could not initialize pipeline\n");
+        if (source)
+            gst_object_unref(source);
+        for (i = 0; sinks[i]; i++)
+            gst_object_unref(sinks[i]);
+        g_free(sinks);
+        gst_object_unref(pipeline);
+        for (i = 0; i < nsinks; i++)
+            rets[i] = -2;
+        return;
+    }
+
+    g_object_set(G_OBJECT(source), "location", filename, NULL);
+
+    branches = g_new(struct tee_branch, nsinks);
+    threads = g_new(pthread_t, nsinks);
+    for (i = 0; i < nsinks; i++)
+    {
+        branches[i].filename = filename;
+        branches[i].dest = sinks[i];
+        branches[i].add_data_cb = add_data_cb;
+        branches[i].user_data = user_data[i];
+        branches[i].ret = 0;
+        branches[i].live = &live;
+        branches[i].sinks = sinks;
+    }
+
+    bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+    gst_bus_set_sync_handler(bus, tee_bus_handler, sinks);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    /* the first branch is pulled right here */
+    for (n = 1; n < nsinks; n++)
+    {
+        if (pthread_create(&threads[n], NULL, pull_branch, &branches[n]))
+            break;
+    }
+
+    /* a branch nobody pulls would stall the tee, so stop everything */
+    if (n < nsinks)
+    {
+        fprintf(stderr, "gstfs: could not start transcode thread\n");
+        send_eos(sinks);
+    }
+
+    pull_branch(&branches[0]);
+    for (i = n; i < nsinks; i++)
+        pull_branch(&branches[i]);
+    for (i = 1; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    message = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+    failed = (message != NULL || n < nsinks);
+    if (message)
+        gst_message_unref(message);
+
+    for (i = 0; i < nsinks; i++)
+        rets[i] = (failed && !branches[i].ret) ? -EIO : branches[i].ret;
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_bus_set_sync_handler(bus, NULL, NULL);
+    gst_object_unref(bus);
+    gst_object_unref(source);
+    for (i = 0; i < nsinks; i++)
+        gst_object_unref(sinks[i]);
+    g_free(sinks);
+    g_free(branches);
+    g_free(threads);
+
+    if (failed)
+        gst_object_unref(pipeline);
+    else
+        put_pipeline(pipeline_str, pipeline);
+    TRACE2(transcode_done, filename, failed ? -EIO : 0);
+}
+
+/*
+ *  Preroll filename through a decoder and return its duration in
+ *  nanoseconds, or -1 if it can't be determined.  This is much cheaper
+ *  than a transcode, as only the first buffers get decoded.
+ */
+long long gstfs_source_duration(char *filename)
+{
+    static char *pipeline_str =
+        "filesrc name=\"_source\" ! decodebin ! fakesink";
+    GstElement *pipeline, *source;
+    GstFormat format = GST_FORMAT_TIME;
+    gint64 duration = -1;
+    int prerolled;
+
+    TRACE1(estimate_start, filename);
+    pipeline = get_pipeline(pipeline_str);
+    if (!pipeline)
+        return -1;
+
+    source = gst_bin_get_by_name(GST_BIN(pipeline), "_source");
+    g_object_set(G_OBJECT(source), "location", filename, NULL);
+    gst_object_unref(source);
+
+    gst_element_set_state(pipeline, GST_STATE_PAUSED);
+    prerolled = (gst_element_get_state(pipeline, NULL, NULL,
+        10 * GST_SECOND) == GST_STATE_CHANGE_SUCCESS);
+    if (prerolled &&
+        (!gst_element_query_duration(pipeline, &format, &duration) ||
+         format != GST_FORMAT_TIME))
+        duration = -1;
 
-    return 0;
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    if (prerolled)
+        put_pipeline(pipeline_str, pipeline);
+    else
+        gst_object_unref(pipeline);
+    TRACE2(estimate_done, filename, duration);
+    return duration;
 }
@@ -3,5 +3,12 @@
 
 int gstfs_transcode(char *pipeline, char *filename, 
     int (*add_data_cb)(char *, size_t, void *), void *user_data);
+int gstfs_transcode_range(char *pipeline, char *filename, long long start,
+    long long stop, long long margin,
+    int (*add_data_cb)(char *, size_t, void *), void *user_data);
+void gstfs_transcode_tee(char *pipeline, char *filename, int nsinks,
+    int (*add_data_cb)(char *, size_t, void *), void **user_data, int *rets);
+void gstfs_transcode_set_pool_size(int npipelines);
+long long gstfs_source_duration(char *filename);
 
 #endif /* _XCODE_H */